@@ -6,7 +6,7 @@
 #include <limits.h>
 #include "port.h"
 #include "ploader.h"
-#include "packet.h"
+#include "helper.h"
 #include "osint.h"
 
 #ifndef TRUE
@@ -32,21 +32,31 @@
 /* defaults */
 #define BAUD_RATE       115200
 
-/* constants */
-#define HUB_MEMORY_SIZE 32768
-
 static PL_state state;
 
 static void Usage(void);
 static uint8_t *ReadEntireFile(char *name, long *pSize);
+static int WriteToFile(void *data, uint8_t *buf, int len);
+static int ReadFromFile(void *data, uint8_t *buf, int len);
 
 int main(int argc, char *argv[])
 {
     char actualPort[PATH_MAX], *var, *val, *port, *p;
-    int baudRate, baudRate2, verbose, i;
+    int baudRate, baudRate2, verbose, sts, i;
+    char *helperFile = HL_FindHelper(argv[0]);
+    int busFreq = EEPROM_BUS_FREQ;
+    int pageSize = EEPROM_PAGE_SIZE;
+    int maxBaud = INT_MAX;
+    int writeData = FALSE;
+    int differential = FALSE;
+    uint32_t writeAddr = 0;
+    int readData = FALSE;
+    uint32_t readAddr = 0;
+    int readSize = 0;
     char *file = NULL;
-    long imageSize;
-    uint8_t *image;
+    long imageSize = 0, helperSize;
+    uint8_t *image = NULL, *helper;
+    FILE *fp = NULL;
     
     /* initialize */
     baudRate = baudRate2 = BAUD_RATE;
@@ -87,6 +97,16 @@ int main(int argc, char *argv[])
                     if ((val = strtok(NULL, "")) != NULL) {
                         if (strcmp(var, "reset") == 0)
                             use_reset_method(val);
+                        else if (strcmp(var, "helper") == 0)
+                            helperFile = val;
+                        else if (strcmp(var, "i2cfreq") == 0)
+                            busFreq = atoi(val);
+                        else if (strcmp(var, "pagesize") == 0)
+                            pageSize = atoi(val);
+                        else if (strcmp(var, "maxbaud") == 0)
+                            maxBaud = atoi(val);
+                        else if (strcmp(var, "packettrace") == 0)
+                            SetPacketTrace(atoi(val));
                         else
                             Usage();
                     }
@@ -129,10 +149,34 @@ int main(int argc, char *argv[])
                 ShowPorts(&state, PORT_PREFIX);
                 break;
             case 'r':
+                if (argv[i][2])
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    Usage();
+                readAddr = (uint32_t)strtoul(p, &p, 0);
+                if (*p++ != ':')
+                    Usage();
+                readSize = (int)strtoul(p, NULL, 0);
+                readData = TRUE;
+                break;
+            case 'u':
+                differential = TRUE;
                 break;
             case 'v':
                 verbose = TRUE;
                 break;
+            case 'w':
+                if (argv[i][2])
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    Usage();
+                writeAddr = (uint32_t)strtoul(p, NULL, 0);
+                writeData = TRUE;
+                break;
             case '?':
                 /* fall through */
             default:
@@ -149,6 +193,44 @@ int main(int argc, char *argv[])
         }
     }
     
+    /* make sure there is a file to read or write */
+    if (!file || (readData && writeData))
+        Usage();
+        
+    /* create the file to read into */
+    if (readData) {
+        if (!(fp = fopen(file, "wb"))) {
+            printf("error: creating '%s'\n", file);
+            return 1;
+        }
+    }
+    
+    /* open the data file to write - it is streamed so it can be any size */
+    else if (writeData) {
+        if (!(fp = fopen(file, "rb"))) {
+            printf("error: opening '%s'\n", file);
+            return 1;
+        }
+    }
+    
+    /* read the entire boot image into a buffer */
+    else if (!(image = ReadEntireFile(file, &imageSize))) {
+        printf("error: reading '%s'\n", file);
+        return 1;
+    }
+    
+    /* a boot image must be something the rom can load */
+    if (!readData && !writeData && (sts = PL_ValidateSpinBinary(image, imageSize)) != SPIN_IMAGE_OK) {
+        printf("error: %s\n", PL_SpinImageError(sts));
+        return 1;
+    }
+    
+    /* read the helper */
+    if (!(helper = ReadEntireFile(helperFile, &helperSize))) {
+        printf("error: reading '%s'\n", helperFile);
+        return 1;
+    }
+    
     switch (InitPort(&state, PORT_PREFIX, port, baudRate, verbose, actualPort)) {
     case CHECK_PORT_OK:
         printf("Found propeller version %d on %s\n", state.version, actualPort);
@@ -165,61 +247,64 @@ int main(int argc, char *argv[])
         return 1;
     }
     
-#define HELPER  "pkt_test.binary"
-
-    /* read the entire file into a buffer */
-    if (!(image = ReadEntireFile(HELPER, &imageSize))) {
-        printf("error: reading '%s'\n", HELPER);
+    /* use the fastest rate saved for the adapter by p1load -F unless limited with -Dmaxbaud */
+    if (maxBaud == INT_MAX)
+        GetAdapterMaxBaud(actualPort, &maxBaud);
+    
+    /* start the helper with the clock settings of the boot image or its own otherwise */
+    if ((sts = HL_StartHelper(&state, helper, helperSize, readData || writeData ? NULL : image, maxBaud)) != LOAD_STS_OK) {
+        printf("error: starting the helper\n");
         return 1;
     }
-    
-    /* make sure the file isn't too big for hub memory */
-    if (imageSize > HUB_MEMORY_SIZE) {
-        printf("error: image too big for hub memory\n");
+    if ((sts = HL_ConfigEEPROM(busFreq, pageSize)) != LOAD_STS_OK) {
+        printf("error: starting the eeprom driver\n");
+        HL_StopHelper(&state);
         return 1;
     }
     
-    /* load the file from the memory buffer */
-    printf("Loading '%s' (%ld bytes)\n", HELPER, imageSize);
-    switch (PL_LoadSpinBinary(&state, LOAD_TYPE_RUN, image, imageSize)) {
-    case LOAD_STS_OK:
-        printf("OK\n");
-        break;
-    case LOAD_STS_ERROR:
+    /* read or write the file */
+    if (readData) {
+        printf("Reading %d bytes at 0x%x to '%s' ... ", readSize, readAddr, file);
+        fflush(stdout);
+        sts = HL_ReadEEPROM(readAddr, readSize, WriteToFile, fp);
+        if (fclose(fp) != 0)
+            sts = LOAD_STS_ERROR;
+    }
+    else if (writeData) {
+        printf("Writing '%s' at 0x%x ... ", file, writeAddr);
+        fflush(stdout);
+        sts = HL_WriteEEPROMStream(writeAddr, ReadFromFile, fp);
+        fclose(fp);
+    }
+    else {
+        printf("Writing boot image '%s' (%ld bytes) ... ", file, imageSize);
+        fflush(stdout);
+        sts = HL_WriteEEPROMImage(image, imageSize, differential);
+    }
+    HL_StopHelper(&state);
+    
+    if (sts != LOAD_STS_OK) {
         printf("Error\n");
         return 1;
-    case LOAD_STS_TIMEOUT:
-        printf("Timeout\n");
-        return 1;
-    default:
-        printf("Internal error\n");
-        return 1;
     }
+    printf("OK\n");
     
-{
-enum {
-  OP_RESULT,
-  OP_ADD,
-  OP_SUB
-};
-    int32_t type, sts;
-    int32_t buf[2];
-    while (1) {
-        printf("type and two arguments: ");
-        scanf("%d %d %d", &type, &buf[0], &buf[1]);
-        printf("%d %d %d\n", type, buf[0], buf[1]);
-        printf("sizeof(buf) = %lu\n", sizeof(buf));
-        sts = SendPacket(type, (void *)buf, sizeof(buf));
-        printf("SendPacket returned %d\n", sts);
-        if (sts == 0) {
-            sts = ReceivePacket(&type, (void *)buf, sizeof(buf));
-            printf("ReceivePacket returned %d\n", sts);
-            if (sts >= 0)
-                printf("%d %d\n", type, buf[0]);
-        }
+    if (verbose) {
+        HL_stats stats;
+        HL_GetStats(&stats);
+        printf("%s %d bytes in %d ms at %d baud", readData ? "Read" : "Wrote", stats.imageSize, stats.elapsed, stats.baudRate);
+        if (stats.elapsed > 0)
+            printf(" - %ld bytes/second", (1000L * stats.imageSize) / stats.elapsed);
+        printf("\n");
+        if (stats.skippedSize > 0)
+            printf("Skipped %d bytes that already matched\n", stats.skippedSize);
     }
-}
-
+    
+    /* reset the chip so it boots the new image */
+    if (!readData && !writeData)
+        (*state.reset)(state.serialData);
+    
+    serial_done();
     return 0;
 }
 
@@ -227,17 +312,29 @@ enum {
 static void Usage(void)
 {
 printf("\
-p1load - a simple loader for the propeller - %s, %s\n\
-usage: p1load\n\
+eeprom - a fast eeprom reader and writer for the propeller - %s, %s\n\
+usage: eeprom\n\
          [ -b baud ]               baud rate (default is %d)\n\
          [ -D var=val ]            set variable value\n\
          [ -p port ]               serial port (default is to auto-detect the port)\n\
          [ -P ]                    list available serial ports\n\
-         [ -r addr:len ]           read from eeprom\n\
+         [ -r addr:len ]           read len bytes at addr from eeprom into the file\n\
+         [ -u ]                    only write the boot image pages that changed\n\
          [ -v ]                    verbose output\n\
-         [ -w addr                 write to eeprom\n\
+         [ -w addr ]               write the file as data at addr\n\
          [ -? ]                    display a usage message and exit\n\
-         file                      file to load\n", VERSION, __DATE__, BAUD_RATE);
+         file                      file to write or read into\n", VERSION, __DATE__, BAUD_RATE);
+printf("\n\
+Without -w the file is written as a boot image and the chip is reset to run it.\n\
+Only the pages up to the end of the image's variables are written.\n\
+\n\
+Writes go through the helper read from '%s' in the current directory or the\n\
+directory of eeprom (where make helper puts it) unless another file is given\n\
+with option: -Dhelper=file. The i2c bus runs at %d Hz with %d byte pages\n\
+unless changed with options: -Di2cfreq=hz and -Dpagesize=bytes.\n\
+\n\
+Helper packets can be traced with option: -Dpackettrace=level (1 or 2).\n\
+", HELPER_FILE, EEPROM_BUS_FREQ, EEPROM_PAGE_SIZE);
 #ifdef RASPBERRY_PI
 printf("\
 \n\
@@ -249,6 +346,20 @@ defaults to GPIO 17 and level 0.\n\
     exit(1);
 }
 
+/* WriteToFile - write eeprom data to a file as it arrives */
+static int WriteToFile(void *data, uint8_t *buf, int len)
+{
+    return fwrite(buf, 1, len, (FILE *)data) == len;
+}
+
+/* ReadFromFile - read data to write to the eeprom from a file */
+static int ReadFromFile(void *data, uint8_t *buf, int len)
+{
+    FILE *fp = (FILE *)data;
+    int cnt = (int)fread(buf, 1, len, fp);
+    return cnt > 0 || !ferror(fp) ? cnt : -1;
+}
+
 /* ReadEntireFile - read an entire file into an allocated buffer */
 static uint8_t *ReadEntireFile(char *name, long *pSize)
 {
@@ -0,0 +1,997 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "helper.h"
+#include "packet.h"
+#include "osint.h"
+
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+/* spin binary header offsets */
+#define SPIN_HDR_CLKFREQ        0
+#define SPIN_HDR_CLKMODE        4
+#define SPIN_HDR_CHECKSUM       5
+#define SPIN_HDR_DBASE          10
+#define SPIN_HDR_SIZE           16
+
+/* the rom boots the first 32K of the eeprom */
+#define HUB_SIZE                32768
+
+/* initial stack frame long written below dbase */
+#define STACK_FRAME             0xfff9ffff
+
+/* checksum contribution of the two stack frame longs ($fff9ffff) written by the rom loader */
+#define STACK_FRAME_CHECKSUM    0xec
+
+/* number of pings to wait for the helper to start (the packet driver takes a second to start) */
+#define HELPER_START_RETRIES    5
+
+/* milliseconds to wait after the helper acknowledges a baud change
+   (it waits 10ms before restarting its packet driver at the new rate) */
+#define HELPER_BAUD_DELAY       25
+
+/* number of times to send a packet before giving up */
+#define PACKET_RETRIES          3
+
+/* minimum number of clock cycles per bit that the packet driver can receive back to back */
+#define MIN_BIT_TICKS           160
+
+/* eeprom data bytes per write packet (a multiple of any page size) */
+#define EEPROM_CHUNK_SIZE       (PKTMAXLEN / 2)
+
+/* eeprom bytes summed or hashed per packet (keeps the reply well within the packet timeout) */
+#define EEPROM_SUM_CHUNK        4096
+
+/* flash data bytes per stream packet (two flash pages) */
+#define XMEM_CHUNK_SIZE         (PKTMAXLEN / 2)
+
+/* flash bytes checked per crc packet (keeps the reply well within the packet timeout) */
+#define XMEM_CRC_CHUNK          32768
+
+/* milliseconds the helper waits for a result before replying (keeps the reply within the packet timeout) */
+#define WAIT_SLICE              500
+
+/* milliseconds between bridge status requests */
+#define BRIDGE_POLL_INTERVAL    100
+
+/* packets echoed at each baud rate by HL_ProbeBaudRate */
+#define PROBE_PACKETS           10
+
+/* milliseconds of silence after which an interrupted eeprom read stream is over */
+#define DRAIN_TIMEOUT           250
+
+/* run length encoding limits - must match the expansion code in packet_driver.spin */
+#define RLE_MIN_RUN             3
+#define RLE_MAX_RUN             130
+#define RLE_MAX_LITERAL         128
+
+/* baud rates to try in order of preference */
+static const int baudRates[] = { 921600, 460800, 230400, 115200, 0 };
+
+/* statistics for the last transfer */
+static HL_stats stats;
+
+/* eeprom page size set by HL_ConfigEEPROM */
+static int eepromPageSize = EEPROM_PAGE_SIZE;
+
+/* lowest hub address that HL_RunImage can use - set by HL_StartHelper */
+static int freeBase = HUB_SIZE;
+
+static int SwitchBaudRate(uint32_t clkfreq, int baud, int maxBaud);
+static int SetBaudRate(int baud);
+static int WaitForHelper(void);
+static int EchoPackets(int count);
+static int Transact(int type, uint8_t *buf, int len);
+static int TransactReply(int type, uint8_t *buf, int len, uint8_t *reply, int replyLen);
+static int WriteChangedPages(uint8_t *buf, int size);
+static int WriteHub(int addr, uint8_t *data, int size);
+static int SendWindowed(uint8_t *image, int imageSize);
+static void DrainInput(void);
+static uint32_t UpdateCrc32(uint32_t crc, uint8_t *buf, int len);
+static uint32_t Crc32(uint8_t *buf, int len);
+static int RLECompress(uint8_t *in, int inSize, uint8_t *out, int outMax, int *pConsumed);
+static uint32_t GetLong(uint8_t *buf);
+static void SetLong(uint8_t *buf, uint32_t value);
+
+int HL_SendImage(uint8_t *image, int imageSize, int compress)
+{
+    uint8_t packet[PKTMAXLEN], *payload;
+    int seq, type, len, i, n;
+    unsigned long start;
+
+    /* hand control over to the packet driver loader */
+    if (Transact(HELPER_LOAD, NULL, 0) != PKT_ACK)
+        return LOAD_STS_ERROR;
+
+    /* send the image with several frames in flight unless it's compressed or reaches the
+       top of hub memory where the helper puts the window status */
+    start = msclock();
+    if (!compress && imageSize <= LOAD_RLE_BUFFER) {
+        if (SendWindowed(image, imageSize) != LOAD_STS_OK)
+            return LOAD_STS_ERROR;
+        stats.imageSize += imageSize;
+    }
+    else {
+        for (seq = 0, i = 0; i < imageSize; i += n, seq ^= 1) {
+            n = imageSize - i;
+            if (n > PKTMAXLEN)
+                n = PKTMAXLEN;
+            type = LOAD_DATA0 | seq;
+            payload = &image[i];
+            len = n;
+        
+            /* compress the data if it fits below the expansion buffer and actually gets smaller */
+            if (compress && i < LOAD_RLE_BUFFER) {
+                int avail = (imageSize < LOAD_RLE_BUFFER ? imageSize : LOAD_RLE_BUFFER) - i;
+                int consumed, clen;
+                clen = RLECompress(&image[i], avail, packet, sizeof(packet), &consumed);
+                if (consumed > clen) {
+                    type = LOAD_RLE0 | seq;
+                    payload = packet;
+                    len = clen;
+                    n = consumed;
+                }
+            }
+        
+            if (Transact(type, payload, len) != PKT_ACK)
+                return LOAD_STS_ERROR;
+            stats.imageSize += n;
+            stats.sentSize += len;
+        }
+    }
+
+    /* start the program */
+    if (Transact(LOAD_RUN, NULL, 0) != PKT_ACK)
+        return LOAD_STS_ERROR;
+
+    stats.elapsed += (int)(msclock() - start);
+    return LOAD_STS_OK;
+}
+
+int HL_RunImage(uint8_t *image, int imageSize)
+{
+    uint8_t packet[4];
+    int loadSize, dbase, base;
+
+    /* put the image just above the helper to leave it as much stack as possible */
+    if (imageSize < SPIN_HDR_SIZE)
+        return LOAD_STS_ERROR;
+    loadSize = PL_SpinLoadSize(image, imageSize);
+    dbase = image[SPIN_HDR_DBASE] | (image[SPIN_HDR_DBASE + 1] << 8);
+    base = (freeBase + 3) & ~3;
+    if (base + dbase >= HUB_SIZE)
+        return LOAD_STS_ERROR;
+
+    /* copy it to hub memory */
+    if (WriteHub(base, image, loadSize) != LOAD_STS_OK)
+        return LOAD_STS_ERROR;
+
+    /* start it */
+    SetLong(packet, base);
+    if (Transact(HELPER_RUN, packet, 4) != PKT_ACK)
+        return LOAD_STS_ERROR;
+
+    return LOAD_STS_OK;
+}
+
+int HL_WaitForResult(int timeout, uint32_t *pResult)
+{
+    unsigned long start = msclock();
+    uint8_t buf[4], reply[4];
+    int remaining;
+
+    /* ask in slices so each reply comes back within the packet timeout */
+    while ((remaining = timeout - (int)(msclock() - start)) > 0) {
+        SetLong(buf, remaining < WAIT_SLICE ? remaining : WAIT_SLICE);
+        if (TransactReply(HELPER_WAIT, buf, sizeof(buf), reply, sizeof(reply)) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        if ((*pResult = GetLong(reply)) != 0)
+            return LOAD_STS_OK;
+    }
+
+    return LOAD_STS_TIMEOUT;
+}
+
+int HL_StopImage(void)
+{
+    return Transact(HELPER_STOP, NULL, 0) == PKT_ACK ? LOAD_STS_OK : LOAD_STS_ERROR;
+}
+
+int HL_BridgeLoad(uint8_t *image, int imageSize, int loadType, HL_bridge *chips, int count, int baudRate, int simulate, int timeout)
+{
+    uint8_t packet[20 + BRIDGE_MAX * 4], reply[BRIDGE_MAX * 4];
+    int loadSize, base, busy, i;
+    unsigned long start;
+
+    /* the helper only needs the part of the image the rom loader needs */
+    if (count < 1 || count > BRIDGE_MAX || imageSize < SPIN_HDR_SIZE)
+        return LOAD_STS_ERROR;
+    loadSize = PL_SpinLoadSize(image, imageSize);
+    base = (freeBase + 3) & ~3;
+    if (base + loadSize > HUB_SIZE)
+        return LOAD_STS_ERROR;
+
+    /* send one copy of it for all of the chips */
+    start = msclock();
+    if (WriteHub(base, image, loadSize) != LOAD_STS_OK)
+        return LOAD_STS_ERROR;
+
+    /* start the loads */
+    SetLong(&packet[0], base);
+    SetLong(&packet[4], loadSize / 4);
+    SetLong(&packet[8], loadType);
+    SetLong(&packet[12], baudRate);
+    SetLong(&packet[16], simulate ? BRIDGE_SIMULATE : 0);
+    for (i = 0; i < count; ++i) {
+        SetLong(&packet[20 + i * 4], chips[i].resetPin | (chips[i].rxPin << 8) | (chips[i].txPin << 16));
+        chips[i].status = BRIDGE_STS_BUSY;
+        chips[i].version = 0;
+    }
+    if (Transact(HELPER_BRIDGE_START, packet, 20 + count * 4) != PKT_ACK)
+        return LOAD_STS_ERROR;
+
+    /* wait for all of them to finish */
+    do {
+        msleep(BRIDGE_POLL_INTERVAL);
+        if (TransactReply(HELPER_BRIDGE_STATUS, NULL, 0, reply, count * 4) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        for (busy = FALSE, i = 0; i < count; ++i) {
+            uint32_t value = GetLong(&reply[i * 4]);
+            chips[i].status = value & 0xff;
+            chips[i].version = (value >> 8) & 0xff;
+            if (chips[i].status == BRIDGE_STS_BUSY)
+                busy = TRUE;
+        }
+    } while (busy && (int)(msclock() - start) < timeout);
+    stats.elapsed += (int)(msclock() - start);
+
+    /* release the pins */
+    if (HL_StopImage() != LOAD_STS_OK)
+        return LOAD_STS_ERROR;
+
+    if (busy)
+        return LOAD_STS_TIMEOUT;
+    for (i = 0; i < count; ++i)
+        if (chips[i].status != BRIDGE_STS_OK)
+            return LOAD_STS_ERROR;
+
+    return LOAD_STS_OK;
+}
+
+void HL_GetStats(HL_stats *pStats)
+{
+    *pStats = stats;
+}
+
+char *HL_FindHelper(const char *progName)
+{
+    static char path[PATH_MAX];
+    const char *p, *dirEnd = NULL;
+    FILE *fp;
+
+    /* use the one in the current directory if there is one */
+    if ((fp = fopen(HELPER_FILE, "rb")) != NULL) {
+        fclose(fp);
+        return HELPER_FILE;
+    }
+
+    /* otherwise look next to the program */
+    for (p = progName; *p; ++p)
+        if (*p == '/' || *p == '\\')
+            dirEnd = p + 1;
+    if (!dirEnd || (size_t)(dirEnd - progName) + sizeof(HELPER_FILE) > sizeof(path))
+        return HELPER_FILE;
+    memcpy(path, progName, dirEnd - progName);
+    strcpy(&path[dirEnd - progName], HELPER_FILE);
+
+    return path;
+}
+
+int HL_StartHelper(PL_state *state, uint8_t *helper, int helperSize, uint8_t *image, int maxBaud)
+{
+    uint8_t *patched;
+    int dbase, chk, sts, i;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.baudRate = state->baudRate;
+
+    /* make sure the helper has a header */
+    if (helperSize < SPIN_HDR_SIZE)
+        return LOAD_STS_ERROR;
+
+    /* run the helper with the same clock settings as the image */
+    if (!(patched = (uint8_t *)malloc(helperSize)))
+        return LOAD_STS_ERROR;
+    memcpy(patched, helper, helperSize);
+    if (image) {
+        memcpy(&patched[SPIN_HDR_CLKFREQ], &image[SPIN_HDR_CLKFREQ], 4);
+        patched[SPIN_HDR_CLKMODE] = image[SPIN_HDR_CLKMODE];
+    }
+
+    /* fix the checksum */
+    dbase = patched[SPIN_HDR_DBASE] | (patched[SPIN_HDR_DBASE + 1] << 8);
+    patched[SPIN_HDR_CHECKSUM] = 0;
+    for (chk = STACK_FRAME_CHECKSUM, i = 0; i < helperSize; ++i) {
+        if (i < dbase - 8 || i >= dbase)
+            chk += patched[i];
+    }
+    patched[SPIN_HDR_CHECKSUM] = (uint8_t)-chk;
+
+    /* images run by the helper go above its variables and stack */
+    freeBase = dbase + HELPER_STACK_SIZE;
+
+    /* load the helper and wait for it to start without any replies left from an earlier one */
+    FlushPackets();
+    sts = PL_LoadSpinBinary(state, LOAD_TYPE_RUN, patched, helperSize);
+    if (sts == LOAD_STS_OK)
+        sts = WaitForHelper();
+
+    /* switch to a faster baud rate if the clock frequency allows it */
+    if (sts == LOAD_STS_OK)
+        sts = SwitchBaudRate(GetLong(&patched[SPIN_HDR_CLKFREQ]), state->baudRate, maxBaud);
+
+    free(patched);
+    if (sts != LOAD_STS_OK)
+        HL_StopHelper(state);
+    return sts;
+}
+
+void HL_StopHelper(PL_state *state)
+{
+    if (stats.baudRate != state->baudRate) {
+        serial_baud(state->baudRate);
+        stats.baudRate = state->baudRate;
+    }
+}
+
+int HL_Shutdown(void)
+{
+    uint8_t ignored[sizeof(uint32_t)];
+    int type;
+
+    /* send it just once since a helper that got it can't answer a resend */
+    if (SendPacket(HELPER_SHUTDOWN, NULL, 0) != 0)
+        return LOAD_STS_ERROR;
+    if (ReceivePacket(&type, ignored, sizeof(ignored)) >= 0)
+        return type == PKT_ACK ? LOAD_STS_OK : LOAD_STS_ERROR;
+
+    /* without an ack the helper only shut down if it no longer answers */
+    return Transact(HELPER_PING, NULL, 0) == PKT_ACK ? LOAD_STS_ERROR : LOAD_STS_OK;
+}
+
+int HL_ConfigEEPROM(int busFreq, int pageSize)
+{
+    uint8_t buf[8];
+
+    /* the helper splits writes at page boundaries with a mask */
+    if (pageSize <= 0 || (pageSize & (pageSize - 1)) != 0 || EEPROM_CHUNK_SIZE % pageSize != 0)
+        return LOAD_STS_ERROR;
+
+    SetLong(&buf[0], busFreq);
+    SetLong(&buf[4], pageSize);
+    if (Transact(HELPER_EEPROM_CONFIG, buf, sizeof(buf)) != PKT_ACK)
+        return LOAD_STS_ERROR;
+    eepromPageSize = pageSize;
+
+    return LOAD_STS_OK;
+}
+
+int HL_WriteEEPROM(uint32_t addr, uint8_t *data, int size)
+{
+    uint8_t packet[4 + EEPROM_CHUNK_SIZE];
+    unsigned long start = msclock();
+    int n;
+
+    while (size > 0) {
+
+        /* keep the chunks aligned to pages after the first one */
+        n = EEPROM_CHUNK_SIZE - (addr % EEPROM_CHUNK_SIZE);
+        if (n > size)
+            n = size;
+
+        SetLong(packet, addr);
+        memcpy(&packet[4], data, n);
+        if (Transact(HELPER_EEPROM_WRITE, packet, 4 + n) != PKT_ACK)
+            return LOAD_STS_ERROR;
+
+        stats.imageSize += n;
+        stats.sentSize += 4 + n;
+        addr += n;
+        data += n;
+        size -= n;
+    }
+
+    stats.elapsed += (int)(msclock() - start);
+    return LOAD_STS_OK;
+}
+
+int HL_WriteEEPROMStream(uint32_t addr, HL_source_fn *fn, void *data)
+{
+    uint8_t packet[EEPROM_CHUNK_SIZE];
+    unsigned long start = msclock();
+    uint32_t first = addr, sum = 0, eepromSum;
+    int end = FALSE, seq = 0, max, n, cnt, i;
+
+    /* start the stream - the helper asks for each block with PKT_ACK once it has room for it */
+    SetLong(packet, addr);
+    if (Transact(HELPER_EEPROM_STREAM, packet, 4) != PKT_ACK)
+        return LOAD_STS_ERROR;
+
+    while (!end) {
+
+        /* fill the next block keeping the blocks after the first one aligned to pages */
+        max = EEPROM_CHUNK_SIZE - (addr % EEPROM_CHUNK_SIZE);
+        for (n = 0; n < max; n += cnt) {
+            if ((cnt = (*fn)(data, &packet[n], max - n)) < 0)
+                return LOAD_STS_ERROR;
+            else if (cnt == 0) {
+                end = TRUE;
+                break;
+            }
+        }
+
+        /* send it while the eeprom writes the previous block - the reply to the last one
+           comes once everything is written */
+        if (Transact(EEPROM_DATA0 | seq | (end ? STREAM_LAST : 0), packet, n) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        for (i = 0; i < n; ++i)
+            sum += packet[i];
+        stats.imageSize += n;
+        stats.sentSize += n;
+        addr += n;
+        seq ^= 1;
+    }
+
+    /* the blocks were acknowledged before they were written so check what reached the eeprom */
+    if (addr > first) {
+        if (HL_SumEEPROM(first, addr - first, &eepromSum) != LOAD_STS_OK || eepromSum != sum)
+            return LOAD_STS_ERROR;
+    }
+
+    stats.elapsed += (int)(msclock() - start);
+    return LOAD_STS_OK;
+}
+
+int HL_SumEEPROM(uint32_t addr, int size, uint32_t *pSum)
+{
+    uint8_t buf[8], reply[4];
+    uint32_t sum = 0;
+    int n;
+
+    while (size > 0) {
+        n = size < EEPROM_SUM_CHUNK ? size : EEPROM_SUM_CHUNK;
+        SetLong(&buf[0], addr);
+        SetLong(&buf[4], n);
+        if (TransactReply(HELPER_EEPROM_SUM, buf, sizeof(buf), reply, sizeof(reply)) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        sum += GetLong(reply);
+        addr += n;
+        size -= n;
+    }
+
+    *pSum = sum;
+    return LOAD_STS_OK;
+}
+
+int HL_HashEEPROM(uint32_t addr, int size, uint32_t *hashes)
+{
+    uint8_t buf[8], reply[PKTMAXLEN];
+    int maxSize, n, count, i;
+
+    /* limit the hashes to what fits in a reply */
+    maxSize = (PKTMAXLEN / sizeof(uint32_t)) * eepromPageSize;
+    if (maxSize > EEPROM_SUM_CHUNK)
+        maxSize = EEPROM_SUM_CHUNK;
+
+    while (size > 0) {
+        n = size < maxSize ? size : maxSize;
+        count = (n + eepromPageSize - 1) / eepromPageSize;
+        SetLong(&buf[0], addr);
+        SetLong(&buf[4], n);
+        if (TransactReply(HELPER_EEPROM_HASH, buf, sizeof(buf), reply, count * sizeof(uint32_t)) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        for (i = 0; i < count; ++i)
+            *hashes++ = GetLong(&reply[i * sizeof(uint32_t)]);
+        addr += n;
+        size -= n;
+    }
+
+    return LOAD_STS_OK;
+}
+
+int HL_ReadEEPROM(uint32_t addr, int size, HL_data_fn *fn, void *data)
+{
+    uint8_t buf[8], packet[PKTMAXLEN];
+    unsigned long start = msclock();
+    int retries = PACKET_RETRIES, seq, type, n;
+    uint32_t crc;
+
+    while (size > 0) {
+
+        /* ask for the rest of the range */
+        SetLong(&buf[0], addr);
+        SetLong(&buf[4], size);
+        if (SendPacket(HELPER_EEPROM_READ, buf, sizeof(buf)) != 0)
+            return LOAD_STS_ERROR;
+
+        /* pass each data packet on as it arrives */
+        crc = 0xffffffff;
+        for (seq = 0; (n = ReceivePacket(&type, packet, sizeof(packet))) >= 0
+                   && type == (EEPROM_DATA0 | seq)
+                   && n <= size; seq ^= 1) {
+            if (!(*fn)(data, packet, n))
+                return LOAD_STS_ERROR;
+            crc = UpdateCrc32(crc, packet, n);
+            stats.imageSize += n;
+            addr += n;
+            size -= n;
+        }
+
+        /* the helper finishes with the crc of everything it sent */
+        if (n == sizeof(uint32_t) && type == PKT_ACK && size == 0) {
+            if (GetLong(packet) != ~crc)
+                return LOAD_STS_ERROR;
+            break;
+        }
+
+        /* a packet was lost - the data already passed on had good packet crcs so drop the
+           rest of the stream and ask for what is left */
+        if (--retries < 0)
+            return LOAD_STS_ERROR;
+        DrainInput();
+    }
+
+    stats.elapsed += (int)(msclock() - start);
+    return LOAD_STS_OK;
+}
+
+int HL_WriteEEPROMImage(uint8_t *image, int imageSize, int differential)
+{
+    uint32_t tailSum, sum, eepromSum;
+    int dbase, size, sts, i;
+    uint8_t *buf;
+
+    /* write through the end of the page containing the initial stack frame */
+    if (imageSize < SPIN_HDR_SIZE)
+        return LOAD_STS_ERROR;
+    dbase = image[SPIN_HDR_DBASE] | (image[SPIN_HDR_DBASE + 1] << 8);
+    if (dbase < SPIN_HDR_SIZE + 8 || dbase > HUB_SIZE)
+        return LOAD_STS_ERROR;
+    size = (dbase + eepromPageSize - 1) & ~(eepromPageSize - 1);
+
+    /* the image followed by zeros and the initial stack frame, as the rom loader leaves hub memory */
+    if (!(buf = (uint8_t *)calloc(size, 1)))
+        return LOAD_STS_ERROR;
+    memcpy(buf, image, imageSize < size ? imageSize : size);
+    SetLong(&buf[dbase - 8], STACK_FRAME);
+    SetLong(&buf[dbase - 4], STACK_FRAME);
+
+    /* the rom checks the sum of all 32K so the checksum has to cover what is already above the image */
+    if ((sts = HL_SumEEPROM(size, HUB_SIZE - size, &tailSum)) != LOAD_STS_OK)
+        goto done;
+    buf[SPIN_HDR_CHECKSUM] = 0;
+    for (sum = 0, i = 0; i < size; ++i)
+        sum += buf[i];
+    buf[SPIN_HDR_CHECKSUM] = (uint8_t)-(sum + tailSum);
+    sum += buf[SPIN_HDR_CHECKSUM];
+
+    /* only write the pages that changed */
+    if (differential) {
+        sts = WriteChangedPages(buf, size);
+        goto done;
+    }
+
+    /* write the pages and make sure they read back with the same sum */
+    if ((sts = HL_WriteEEPROM(0, buf, size)) != LOAD_STS_OK)
+        goto done;
+    if ((sts = HL_SumEEPROM(0, size, &eepromSum)) == LOAD_STS_OK && eepromSum != sum)
+        sts = LOAD_STS_ERROR;
+
+done:
+    free(buf);
+    return sts;
+}
+
+int HL_ConfigXMem(int csPin, int clkPin, int mosiPin, int misoPin, uint32_t *pId)
+{
+    uint8_t buf[4], reply[4];
+    SetLong(buf, csPin | (clkPin << 8) | (mosiPin << 16) | (misoPin << 24));
+    if (TransactReply(HELPER_XMEM_CONFIG, buf, sizeof(buf), reply, sizeof(reply)) != PKT_ACK)
+        return LOAD_STS_ERROR;
+    *pId = GetLong(reply);
+    return LOAD_STS_OK;
+}
+
+int HL_WriteXMem(uint32_t addr, uint8_t *data, int size)
+{
+    uint8_t packet[4 + XMEM_CHUNK_SIZE], buf[8], reply[4];
+    unsigned long start = msclock();
+    int n, i;
+
+    /* the driver erases a sector when a write reaches its first byte */
+    if (addr % XMEM_SECTOR_SIZE != 0)
+        return LOAD_STS_ERROR;
+
+    /* send each block while the flash writes the previous one */
+    for (i = 0; i < size; i += n) {
+        n = size - i;
+        if (n > XMEM_CHUNK_SIZE)
+            n = XMEM_CHUNK_SIZE;
+        SetLong(packet, addr + i);
+        memcpy(&packet[4], &data[i], n);
+        if (Transact(HELPER_XMEM_STREAM, packet, 4 + n) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        stats.imageSize += n;
+        stats.sentSize += 4 + n;
+    }
+
+    /* wait for the last block to be written */
+    if (Transact(HELPER_XMEM_SYNC, NULL, 0) != PKT_ACK)
+        return LOAD_STS_ERROR;
+
+    /* check what was written */
+    for (i = 0; i < size; i += n) {
+        n = size - i;
+        if (n > XMEM_CRC_CHUNK)
+            n = XMEM_CRC_CHUNK;
+        SetLong(&buf[0], addr + i);
+        SetLong(&buf[4], n);
+        if (TransactReply(HELPER_XMEM_CRC, buf, sizeof(buf), reply, sizeof(reply)) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        if (GetLong(reply) != Crc32(&data[i], n))
+            return LOAD_STS_ERROR;
+    }
+
+    stats.elapsed += (int)(msclock() - start);
+    return LOAD_STS_OK;
+}
+
+int HL_ProbeBaudRate(PL_state *state, uint8_t *helper, int helperSize, int maxBaud, HL_probe *steps, int *pCount, int *pBaudRate)
+{
+    uint32_t clkfreq;
+    int count, sts, i;
+
+    *pCount = 0;
+    *pBaudRate = 0;
+
+    /* the helper runs with its own clock settings */
+    if (helperSize < SPIN_HDR_SIZE)
+        return LOAD_STS_ERROR;
+    clkfreq = GetLong(&helper[SPIN_HDR_CLKFREQ]);
+
+    /* try the loader baud rate and then each faster one both sides support in rising order */
+    steps[0].baudRate = state->baudRate;
+    count = 1;
+    for (i = 0; baudRates[i] != 0; ++i)
+        ;
+    while (--i >= 0 && count < PROBE_MAX_STEPS) {
+        if (baudRates[i] > state->baudRate
+        &&  baudRates[i] <= maxBaud
+        &&  clkfreq / baudRates[i] >= MIN_BIT_TICKS
+        &&  serial_baud_supported(baudRates[i]))
+            steps[count++].baudRate = baudRates[i];
+    }
+
+    /* start the helper at the loader baud rate */
+    if ((sts = HL_StartHelper(state, helper, helperSize, NULL, state->baudRate)) != LOAD_STS_OK)
+        return sts;
+
+    /* echo packets at each rate until one loses or corrupts a packet */
+    for (i = 0; i < count; ++i) {
+        steps[i].packets = PROBE_PACKETS;
+        ++*pCount;
+
+        /* a helper that can't be reached at the new rate loses every packet */
+        if (steps[i].baudRate != stats.baudRate && SetBaudRate(steps[i].baudRate) != LOAD_STS_OK)
+            steps[i].errors = PROBE_PACKETS;
+        else
+            steps[i].errors = EchoPackets(PROBE_PACKETS);
+
+        if (steps[i].errors != 0)
+            break;
+        *pBaudRate = steps[i].baudRate;
+    }
+
+    HL_StopHelper(state);
+    return LOAD_STS_OK;
+}
+
+/* SwitchBaudRate - switch the helper and the host to the fastest baud rate the helper can handle */
+static int SwitchBaudRate(uint32_t clkfreq, int baud, int maxBaud)
+{
+    int i;
+
+    /* find the fastest baud rate both sides support */
+    for (i = 0; baudRates[i] != 0; ++i) {
+        if (baudRates[i] <= maxBaud
+        &&  clkfreq / baudRates[i] >= MIN_BIT_TICKS
+        &&  serial_baud_supported(baudRates[i]))
+            break;
+    }
+
+    /* stay at the current baud rate unless a faster one is available */
+    if (baudRates[i] <= baud)
+        return LOAD_STS_OK;
+
+    return SetBaudRate(baudRates[i]);
+}
+
+/* SetBaudRate - switch the helper and the host to a baud rate */
+static int SetBaudRate(int baud)
+{
+    uint8_t buf[4], ignored[sizeof(uint32_t)];
+    int type;
+
+    /* tell the helper to switch just once - if the ack is lost the helper has already
+       switched and a resend at the old rate can never get through */
+    SetLong(buf, baud);
+    if (SendPacket(HELPER_BAUD, buf, sizeof(buf)) != 0)
+        return LOAD_STS_ERROR;
+    if (ReceivePacket(&type, ignored, sizeof(ignored)) >= 0 && type != PKT_ACK)
+        return LOAD_STS_ERROR;
+
+    /* switch the host once the helper has restarted so the first ping isn't lost and
+       ping at the new rate even without an ack in case only the ack went missing */
+    msleep(HELPER_BAUD_DELAY);
+    serial_baud(baud);
+    FlushPackets();
+    stats.baudRate = baud;
+    return WaitForHelper();
+}
+
+/* SendWindowed - send an image as windowed load frames with up to LOAD_WINDOW_SIZE of them in flight */
+static int SendWindowed(uint8_t *image, int imageSize)
+{
+    uint8_t reply[8];
+    int frameCount = (imageSize + PKTMAXLEN - 1) / PKTMAXLEN;
+    int base = 0, retries = 0, count = 0, last, type, i, n;
+    uint32_t received = 0;
+
+    while (base < frameCount) {
+
+        /* send each frame in the window that hasn't arrived and poll with the last one */
+        for (last = base + LOAD_WINDOW_SIZE - 1; last >= frameCount || (received & (1u << (last - base))); --last)
+            ;
+        for (i = base; i <= last; ++i) {
+            if (received & (1u << (i - base)))
+                continue;
+            n = imageSize - i * PKTMAXLEN;
+            if (n > PKTMAXLEN)
+                n = PKTMAXLEN;
+            type = LOAD_WINDOW | (i & LOAD_SEQ_MASK) | (i == last ? LOAD_POLL : 0);
+            /* the pad gives the helper time to finish the last frame before this one starts */
+            if (SendPaddedPacket(type, &image[i * PKTMAXLEN], n) != 0)
+                return LOAD_STS_ERROR;
+            stats.sentSize += n;
+        }
+
+        /* get the window status skipping anything sent while the window was arriving */
+        while ((n = ReceivePacket(&type, reply, sizeof(reply))) >= 0
+        &&     (type != PKT_ACK || n != sizeof(reply)))
+            ;
+        if (n < 0 || (count = GetLong(reply)) < base || count > frameCount) {
+            if (++retries > PACKET_RETRIES)
+                return LOAD_STS_ERROR;
+            continue;
+        }
+
+        /* give up if the first frame in the window keeps failing and resend the rest that are missing */
+        if (count > base)
+            retries = 0;
+        else if (++retries > PACKET_RETRIES)
+            return LOAD_STS_ERROR;
+        base = count;
+        received = GetLong(&reply[4]);
+    }
+
+    return LOAD_STS_OK;
+}
+
+/* WaitForHelper - ping the helper until it responds */
+static int WaitForHelper(void)
+{
+    int i;
+    for (i = 0; i < HELPER_START_RETRIES; ++i) {
+        if (Transact(HELPER_PING, NULL, 0) == PKT_ACK)
+            return LOAD_STS_OK;
+    }
+    return LOAD_STS_TIMEOUT;
+}
+
+/* EchoPackets - send full packets of pseudo-random data to the helper and count the ones that don't come back intact */
+static int EchoPackets(int count)
+{
+    static uint32_t seed = 1;
+    uint8_t buf[PKTMAXLEN], reply[PKTMAXLEN];
+    int errors = 0, type, i, j;
+
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < PKTMAXLEN; ++j) {
+            seed = seed * 1103515245 + 12345;
+            buf[j] = (uint8_t)(seed >> 16);
+        }
+        if (SendPacket(HELPER_ECHO, buf, PKTMAXLEN) != 0
+        ||  ReceivePacket(&type, reply, sizeof(reply)) != PKTMAXLEN
+        ||  type != PKT_ACK
+        ||  memcmp(reply, buf, PKTMAXLEN) != 0) {
+            DrainInput();
+            ++errors;
+        }
+    }
+
+    return errors;
+}
+
+/* WriteChangedPages - write the runs of pages whose eeprom hashes don't match and verify them */
+static int WriteChangedPages(uint8_t *buf, int size)
+{
+    int pageCount = size / eepromPageSize, sts, first, i;
+    uint32_t *hashes;
+
+    if (!(hashes = (uint32_t *)malloc(pageCount * sizeof(uint32_t))))
+        return LOAD_STS_ERROR;
+
+    /* find the pages that differ */
+    if ((sts = HL_HashEEPROM(0, size, hashes)) != LOAD_STS_OK)
+        goto done;
+    for (i = 0; i < pageCount; ++i)
+        hashes[i] = hashes[i] != Crc32(&buf[i * eepromPageSize], eepromPageSize);
+
+    /* write each run of changed pages */
+    for (i = 0; i < pageCount; ) {
+        if (!hashes[i]) {
+            stats.skippedSize += eepromPageSize;
+            ++i;
+            continue;
+        }
+        for (first = i; i < pageCount && hashes[i]; ++i)
+            ;
+        if ((sts = HL_WriteEEPROM(first * eepromPageSize, &buf[first * eepromPageSize], (i - first) * eepromPageSize)) != LOAD_STS_OK)
+            goto done;
+    }
+
+    /* make sure every page now matches */
+    if (stats.skippedSize < size) {
+        if ((sts = HL_HashEEPROM(0, size, hashes)) != LOAD_STS_OK)
+            goto done;
+        for (i = 0; i < pageCount; ++i) {
+            if (hashes[i] != Crc32(&buf[i * eepromPageSize], eepromPageSize)) {
+                sts = LOAD_STS_ERROR;
+                goto done;
+            }
+        }
+    }
+
+done:
+    free(hashes);
+    return sts;
+}
+
+/* WriteHub - copy data to hub memory above the helper */
+static int WriteHub(int addr, uint8_t *data, int size)
+{
+    uint8_t packet[PKTMAXLEN];
+    int n, i;
+    for (i = 0; i < size; i += n) {
+        n = size - i;
+        if (n > PKTMAXLEN - 4)
+            n = PKTMAXLEN - 4;
+        SetLong(packet, addr + i);
+        memcpy(&packet[4], &data[i], n);
+        if (Transact(HELPER_RAM_WRITE, packet, 4 + n) != PKT_ACK)
+            return LOAD_STS_ERROR;
+        stats.imageSize += n;
+        stats.sentSize += 4 + n;
+    }
+    return LOAD_STS_OK;
+}
+
+/* DrainInput - discard input until the line has been quiet for a while */
+static void DrainInput(void)
+{
+    uint8_t buf[PKTMAXLEN];
+    while (rx_timeout(buf, sizeof(buf), DRAIN_TIMEOUT) != SERIAL_TIMEOUT)
+        ;
+    FlushPackets();
+}
+
+/* UpdateCrc32 - add a buffer to a crc-32 the same way as i2c_driver.spin */
+static uint32_t UpdateCrc32(uint32_t crc, uint8_t *buf, int len)
+{
+    int i;
+    while (--len >= 0) {
+        crc ^= *buf++;
+        for (i = 0; i < 8; ++i)
+            crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+    }
+    return crc;
+}
+
+/* Crc32 - compute the crc-32 of a buffer */
+static uint32_t Crc32(uint8_t *buf, int len)
+{
+    return ~UpdateCrc32(0xffffffff, buf, len);
+}
+
+/* Transact - send a packet and return the type of the reply or -1 if there is no valid reply */
+static int Transact(int type, uint8_t *buf, int len)
+{
+    return TransactReply(type, buf, len, NULL, 0);
+}
+
+/* TransactReply - like Transact but a PKT_ACK reply must have exactly replyLen bytes of data */
+static int TransactReply(int type, uint8_t *buf, int len, uint8_t *reply, int replyLen)
+{
+    uint8_t ignored[sizeof(uint32_t)];
+    int replyType, i, n;
+    for (i = 0; i < PACKET_RETRIES; ++i) {
+        if (SendPacket(type, buf, len) == 0
+        &&  (n = ReceivePacket(&replyType, reply ? reply : ignored, reply ? replyLen : sizeof(ignored))) >= 0
+        &&  replyType != PKT_NAK
+        &&  (!reply || replyType != PKT_ACK || n == replyLen))
+            return replyType;
+    }
+    return -1;
+}
+
+/* RLECompress - compress as much of a buffer as fits in the output, returns the compressed length */
+static int RLECompress(uint8_t *in, int inSize, uint8_t *out, int outMax, int *pConsumed)
+{
+    int i = 0, o = 0, run, lit;
+    
+    while (i < inSize) {
+    
+        /* count repeats of the current byte */
+        for (run = 1; i + run < inSize && run < RLE_MAX_RUN && in[i + run] == in[i]; ++run)
+            ;
+            
+        /* $80-$ff: repeat the next byte 3-130 times */
+        if (run >= RLE_MIN_RUN) {
+            if (o + 2 > outMax)
+                break;
+            out[o++] = 0x80 | (run - RLE_MIN_RUN);
+            out[o++] = in[i];
+            i += run;
+        }
+        
+        /* $00-$7f: copy the next 1-128 bytes up to the start of the next run */
+        else {
+            for (lit = 0; i + lit < inSize && lit < RLE_MAX_LITERAL; ++lit) {
+                if (i + lit + 2 < inSize
+                &&  in[i + lit] == in[i + lit + 1]
+                &&  in[i + lit] == in[i + lit + 2])
+                    break;
+            }
+            if (o + 1 + lit > outMax) {
+                if ((lit = outMax - o - 1) <= 0)
+                    break;
+            }
+            out[o++] = lit - 1;
+            memcpy(&out[o], &in[i], lit);
+            o += lit;
+            i += lit;
+        }
+    }
+    
+    *pConsumed = i;
+    return o;
+}
+
+/* GetLong - get a little endian long from a buffer */
+static uint32_t GetLong(uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/* SetLong - store a little endian long in a buffer */
+static void SetLong(uint8_t *buf, uint32_t value)
+{
+    buf[0] = (uint8_t)value;
+    buf[1] = (uint8_t)(value >> 8);
+    buf[2] = (uint8_t)(value >> 16);
+    buf[3] = (uint8_t)(value >> 24);
+}
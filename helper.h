@@ -0,0 +1,213 @@
+#ifndef __HELPER_H__
+#define __HELPER_H__
+
+#include <stdint.h>
+#include "ploader.h"
+#include "packet.h"
+
+/* helper packet types - must match helper.spin */
+#define HELPER_PING             0x01
+#define HELPER_BAUD             0x02
+#define HELPER_LOAD             0x03
+#define HELPER_EEPROM_CONFIG    0x04
+#define HELPER_EEPROM_WRITE     0x05
+#define HELPER_EEPROM_SUM       0x07
+#define HELPER_EEPROM_HASH      0x08
+#define HELPER_EEPROM_READ      0x09
+#define HELPER_EEPROM_STREAM    0x0a
+#define HELPER_RAM_WRITE        0x0c
+#define HELPER_RUN              0x0d
+#define HELPER_WAIT             0x0e
+#define HELPER_STOP             0x0f
+#define HELPER_BRIDGE_START     0x13
+#define HELPER_BRIDGE_STATUS    0x14
+#define HELPER_ECHO             0x16
+#define HELPER_SHUTDOWN         0x17
+#define HELPER_XMEM_CONFIG      0x30
+#define HELPER_XMEM_STREAM      0x31
+#define HELPER_XMEM_SYNC        0x32
+#define HELPER_XMEM_CRC         0x33
+
+/* hub memory between the helper's dbase and a program it runs - must match helper.spin */
+#define HELPER_STACK_SIZE       1024
+
+/* bridge loads - must match helper.spin and bridge_driver.spin */
+#define BRIDGE_MAX              6
+#define BRIDGE_SIMULATE         0x01
+#define BRIDGE_STS_BUSY         0
+#define BRIDGE_STS_OK           1
+#define BRIDGE_STS_NO_PROPELLER 2
+#define BRIDGE_STS_TIMEOUT      3
+#define BRIDGE_STS_ERROR        4
+
+/* eeprom data packet types - must match helper.spin */
+#define EEPROM_DATA0            0x20
+#define EEPROM_DATA1            0x21
+
+/* packet driver packet types - must match packet_driver.spin */
+#define PKT_ACK                 0x06
+#define PKT_NAK                 0x15
+#define LOAD_DATA0              0x10
+#define LOAD_DATA1              0x11
+#define LOAD_RUN                0x12
+#define LOAD_RLE0               0x18
+#define LOAD_RLE1               0x19
+#define STREAM_LAST             0x40    /* ends a stream (added to EEPROM_DATA0/EEPROM_DATA1) */
+
+/* windowed load packet types - must match packet_driver.spin */
+#define LOAD_WINDOW             0x80    /* image data with a sequence number in the low bits */
+#define LOAD_POLL               0x40    /* asks for the window status after this frame */
+#define LOAD_SEQ_MASK           0x3f
+#define LOAD_WINDOW_SIZE        8       /* most frames in flight */
+
+/* run length encoded packets are expanded from a buffer at the top of hub memory */
+#define LOAD_RLE_BUFFER         (0x8000 - PKTMAXLEN)
+
+/* default helper file name */
+#define HELPER_FILE             "p1helper.binary"
+
+/* eeprom defaults */
+#define EEPROM_BUS_FREQ         400000
+#define EEPROM_PAGE_SIZE        64
+
+/* external flash erase sector size - must match flash_driver.spin */
+#define XMEM_SECTOR_SIZE        4096
+
+/* helper transfer statistics */
+typedef struct {
+    int baudRate;       /* baud rate used for the transfer */
+    int imageSize;      /* bytes of image data loaded */
+    int sentSize;       /* bytes of packet payload sent */
+    int skippedSize;    /* bytes of eeprom left alone because they already matched */
+    int elapsed;        /* milliseconds from the first image packet to the run acknowledgement */
+} HL_stats;
+
+/* a chip loaded through the helper's pins */
+typedef struct {
+    int resetPin;       /* helper pin connected to the chip's reset */
+    int rxPin;          /* helper pin connected to the chip's rx (pin 31) */
+    int txPin;          /* helper pin connected to the chip's tx (pin 30) */
+    int status;         /* BRIDGE_STS_ result set by HL_BridgeLoad */
+    int version;        /* chip version reported by its rom */
+} HL_bridge;
+
+/* largest number of steps in a baud rate probe */
+#define PROBE_MAX_STEPS         8
+
+/* result of each step of HL_ProbeBaudRate */
+typedef struct {
+    int baudRate;
+    int packets;        /* echo packets sent */
+    int errors;         /* echo packets lost or corrupted */
+} HL_probe;
+
+/* HL_SendImage - Sends an image to a helper started with HL_StartHelper in packets, run
+   length encoding them if compress is non-zero. The image replaces the helper so this is
+   always the last job.
+*/
+int HL_SendImage(uint8_t *image, int imageSize, int compress);
+
+/* HL_RunImage - Copies a spin image to the hub memory above the helper and starts it in
+   a spare cog while the helper stays in control. The image runs with the helper's clock
+   settings and its serial pins are held by the helper.
+*/
+int HL_RunImage(uint8_t *image, int imageSize);
+
+/* HL_WaitForResult - Waits up to timeout milliseconds for the image started by HL_RunImage
+   to return a non-zero value from its first method. Returns LOAD_STS_TIMEOUT if it doesn't.
+*/
+int HL_WaitForResult(int timeout, uint32_t *pResult);
+
+/* HL_StopImage - Stops every cog started by the image so the helper can do other jobs. */
+int HL_StopImage(void);
+
+/* HL_BridgeLoad - Copies an image to hub memory above a helper started with HL_StartHelper
+   and has the helper load it into each of count chips on its pins at the same time through
+   their ROM loaders, with pulses timed like the host loader's at baudRate. With simulate set
+   each bridge talks to a simulated ROM on the same pins instead. Sets the status of each chip
+   and returns LOAD_STS_OK only if every load worked or LOAD_STS_TIMEOUT if the loads don't
+   finish within timeout milliseconds.
+*/
+int HL_BridgeLoad(uint8_t *image, int imageSize, int loadType, HL_bridge *chips, int count, int baudRate, int simulate, int timeout);
+
+/* HL_GetStats - Gets the statistics for the last helper transfer. */
+void HL_GetStats(HL_stats *stats);
+
+/* eeprom read data handler - returns zero to stop the read */
+typedef int HL_data_fn(void *data, uint8_t *buf, int len);
+
+/* eeprom write data source - returns the number of bytes put in buf, zero at the end or -1 on error */
+typedef int HL_source_fn(void *data, uint8_t *buf, int len);
+
+/* HL_FindHelper - Returns the default helper file name, or its path in the directory of
+   progName (the program's argv[0]) if it isn't in the current directory. make helper puts it
+   next to the programs it builds.
+*/
+char *HL_FindHelper(const char *progName);
+
+/* HL_StartHelper - Loads the helper with the ROM loader and switches to the fastest baud rate
+   up to maxBaud that the helper supports. The helper runs with the clock settings of image
+   or with its own if image is NULL. Must be called immediately following a successful call
+   to PL_HardwareFound.
+*/
+int HL_StartHelper(PL_state *state, uint8_t *helper, int helperSize, uint8_t *image, int maxBaud);
+
+/* HL_StopHelper - Returns the serial port to its original baud rate. */
+void HL_StopHelper(PL_state *state);
+
+/* HL_Shutdown - Stops every cog including the helper's, leaving the chip shut down the way
+   the ROM loader does after it programs the eeprom. HL_StopHelper must still be called.
+*/
+int HL_Shutdown(void);
+
+/* HL_ConfigEEPROM - Starts the helper's i2c driver. pageSize must be a power of two. */
+int HL_ConfigEEPROM(int busFreq, int pageSize);
+
+/* HL_WriteEEPROM - Writes data to the eeprom starting at addr. */
+int HL_WriteEEPROM(uint32_t addr, uint8_t *data, int size);
+
+/* HL_WriteEEPROMStream - Writes the data from fn to the eeprom starting at addr. The helper
+   receives each block into one of two buffers and asks for the next one while the eeprom
+   is busy with the last, and the byte sum of the whole range is checked at the end.
+*/
+int HL_WriteEEPROMStream(uint32_t addr, HL_source_fn *fn, void *data);
+
+/* HL_SumEEPROM - Gets the sum of the bytes in an eeprom range. */
+int HL_SumEEPROM(uint32_t addr, int size, uint32_t *pSum);
+
+/* HL_HashEEPROM - Gets the crc-32 of each page in an eeprom range. addr must be page aligned. */
+int HL_HashEEPROM(uint32_t addr, int size, uint32_t *hashes);
+
+/* HL_ReadEEPROM - Reads an eeprom range, passing the data to fn as each packet arrives. The
+   helper streams the range at the bus speed and the data is checked against a crc-32 that
+   it sends at the end.
+*/
+int HL_ReadEEPROM(uint32_t addr, int size, HL_data_fn *fn, void *data);
+
+/* HL_WriteEEPROMImage - Writes a spin image to the eeprom so the ROM boots it. Only the
+   pages up to dbase are written and the image checksum is adjusted to account for the
+   rest of the eeprom. If differential is non-zero, pages whose hashes already match are
+   skipped. The result is verified against the eeprom contents.
+*/
+int HL_WriteEEPROMImage(uint8_t *image, int imageSize, int differential);
+
+/* HL_ConfigXMem - Starts the helper's spi flash driver and gets the flash's jedec id. */
+int HL_ConfigXMem(int csPin, int clkPin, int mosiPin, int misoPin, uint32_t *pId);
+
+/* HL_WriteXMem - Writes data of any size to external flash starting at addr, which must be
+   a multiple of XMEM_SECTOR_SIZE. Each sector is erased as the write reaches it and the helper
+   acknowledges each block as soon as it starts writing it so the next block is received while
+   the flash is busy with the last one. The result is verified with a crc-32 of each chunk.
+*/
+int HL_WriteXMem(uint32_t addr, uint8_t *data, int size);
+
+/* HL_ProbeBaudRate - Loads the helper with its own clock settings and echoes packets through
+   it at each baud rate up to maxBaud that the helper and the host support, starting at the
+   loader baud rate. The probe stops at the first rate that loses or corrupts a packet. Fills
+   in steps (up to PROBE_MAX_STEPS) and *pCount with the result of each rate tried and sets
+   *pBaudRate to the fastest rate with no errors or zero if none. Must be called immediately
+   following a successful call to PL_HardwareFound.
+*/
+int HL_ProbeBaudRate(PL_state *state, uint8_t *helper, int helperSize, int maxBaud, HL_probe *steps, int *pCount, int *pBaudRate);
+
+#endif
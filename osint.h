@@ -40,9 +40,13 @@ typedef enum {RESET_WITH_RTS, RESET_WITH_DTR, RESET_WITH_GPIO} reset_method_t;
 
 /* serial i/o routines */
 int use_reset_method(char* method);
+void set_reset_delay(int ms);
+int get_reset_delay(void);
+int serial_id(const char *port, char *id, int size);
 int serial_find(const char* prefix, int (*check)(const char* port, void* data), void* data);
 int serial_init(const char *port, unsigned long baud);
 int serial_baud(unsigned long baud);
+int serial_baud_supported(unsigned long baud);
 void serial_done(void);
 int tx(uint8_t* buff, int n);
 int rx(uint8_t* buff, int n);
@@ -54,5 +58,10 @@ void terminal_mode(int check_for_exit, int pst_mode);
 
 /* miscellaneous functions */
 void msleep(int ms);
+unsigned long msclock(void);
+
+/* read-only file mapping */
+void *map_file(const char *name, long *pSize);
+void unmap_file(void *addr, long size);
 
 #endif
@@ -36,9 +36,13 @@
 #include <poll.h>
 #include <unistd.h>
 #include <termios.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/timeb.h>
+#include <sys/time.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <limits.h>
@@ -62,6 +66,10 @@ static int propellerResetGpioLevel = 0;
 /* Normally we use DTR for reset */
 static reset_method_t reset_method = RESET_WITH_DTR;
 
+/* post-reset delay */
+#define DEFAULT_RESET_DELAY 100
+static int reset_delay = DEFAULT_RESET_DELAY;
+
 int use_reset_method(char* method)
 {
     if (strcasecmp(method, "dtr") == 0)
@@ -109,6 +117,24 @@ int use_reset_method(char* method)
     return 0;
 }
 
+/**
+ * set the delay after reset before the handshake begins
+ * @param ms - delay in milliseconds or -1 to use the default
+ */
+void set_reset_delay(int ms)
+{
+    reset_delay = ms < 0 ? DEFAULT_RESET_DELAY : ms;
+}
+
+/**
+ * get the delay after reset before the handshake begins
+ * @returns delay in milliseconds
+ */
+int get_reset_delay(void)
+{
+    return reset_delay;
+}
+
 static void chk(char *fun, int sts)
 {
     if (sts != 0)
@@ -139,6 +165,41 @@ int serial_find(const char* prefix, int (*check)(const char* port, void* data),
     return -1;
 }
 
+/**
+ * get an identifier for the adapter connected to a port
+ * @param port - port name
+ * @param id - buffer for the identifier
+ * @param size - size of the buffer
+ * @returns 1 if a unique identifier was found and 0 otherwise
+ */
+int serial_id(const char *port, char *id, int size)
+{
+    char path[PATH_MAX + 16], real[PATH_MAX], *p;
+    const char *name;
+    FILE *fp;
+    
+    /* find the device for the tty in sysfs */
+    name = (name = strrchr(port, '/')) != NULL ? name + 1 : port;
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device", name);
+    if (!realpath(path, real))
+        return 0;
+        
+    /* walk up the device tree looking for the usb serial number */
+    while ((p = strrchr(real, '/')) != NULL && p != real) {
+        snprintf(path, sizeof(path), "%s/serial", real);
+        if ((fp = fopen(path, "r")) != NULL) {
+            if (!fgets(id, size, fp))
+                id[0] = '\0';
+            fclose(fp);
+            id[strcspn(id, "\r\n")] = '\0';
+            return id[0] != '\0';
+        }
+        *p = '\0';
+    }
+    
+    return 0;
+}
+
 static void sigint_handler(int signum)
 {
         serial_done();
@@ -187,13 +248,12 @@ int serial_init(const char* port, unsigned long baud)
 }
 
 /**
- * change the baud rate of the serial port
+ * get the termios speed code for a baud rate
  * @param baud - baud rate
- * @returns 1 for success and 0 for failure
+ * @returns speed code or -1 if the baud rate is not supported
  */
-int serial_baud(unsigned long baud)
+static int baud_code(unsigned long baud)
 {
-    struct termios sparm;
     int tbaud;
 
     switch(baud) {
@@ -235,26 +295,53 @@ int serial_baud(unsigned long baud)
             tbaud = B38400;
             break;
         default:
-            printf("Unsupported baudrate. Use ");
+            tbaud = -1;
+            break;
+    }
+    
+    return tbaud;
+}
+
+/**
+ * check whether a baud rate is supported
+ * @param baud - baud rate
+ * @returns 1 if supported and 0 if not
+ */
+int serial_baud_supported(unsigned long baud)
+{
+    return baud_code(baud) != -1;
+}
+
+/**
+ * change the baud rate of the serial port
+ * @param baud - baud rate
+ * @returns 1 for success and 0 for failure
+ */
+int serial_baud(unsigned long baud)
+{
+    struct termios sparm;
+    int tbaud;
+
+    if ((tbaud = baud_code(baud)) == -1) {
+        printf("Unsupported baudrate. Use ");
 #ifdef B921600
-            printf("921600, ");
+        printf("921600, ");
 #endif
 #ifdef B576000
-            printf("576000, ");
+        printf("576000, ");
 #endif
 #ifdef B500000
-            printf("500000, ");
+        printf("500000, ");
 #endif
 #ifdef B460800
-            printf("460800, ");
+        printf("460800, ");
 #endif
 #ifdef B230400
-            printf("230400, ");
+        printf("230400, ");
 #endif
-            printf("115200, 57600, or 38400\n");
-            serial_done();
-            exit(2);
-            break;
+        printf("115200, 57600, or 38400\n");
+        serial_done();
+        exit(2);
     }
 
     /* get the current options */
@@ -430,7 +517,7 @@ void hwreset(void)
     assert_reset();
     msleep(10);
     deassert_reset();
-    msleep(100);
+    msleep(reset_delay);
     tcflush(hSerial, TCIFLUSH);
 }
 
@@ -453,6 +540,49 @@ void msleep(int ms)
 #endif
 }
 
+/**
+ * get the current time in milliseconds
+ * @returns time in milliseconds from an arbitrary starting point
+ */
+unsigned long msclock(void)
+{
+    struct timespec now;
+    /* use the monotonic clock so deadlines don't move when the wall clock is set */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* map_file - map an entire file into memory for reading */
+void *map_file(const char *name, long *pSize)
+{
+    struct stat st;
+    void *addr;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    /* the file is read from start to end once */
+    madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    *pSize = (long)st.st_size;
+    return addr;
+}
+
+/* unmap_file - release a file mapped by map_file */
+void unmap_file(void *addr, long size)
+{
+    munmap(addr, (size_t)size);
+}
+
 #define ESC     0x1b    /* escape from terminal mode */
 
 /**
@@ -106,6 +106,11 @@ int serial_baud(unsigned long baud)
     case 115200:
         state.BaudRate = CBR_115200;
         break;
+    case 230400:        /* no CBR_ constants but usb serial drivers take the rate as is */
+    case 460800:
+    case 921600:
+        state.BaudRate = baud;
+        break;
     default:
         return FALSE;
     }
@@ -124,7 +129,8 @@ int serial_baud(unsigned long baud)
     state.fTXContinueOnXoff = TRUE;
     state.fNull = FALSE;
     state.fAbortOnError = FALSE;
-    SetCommState(hSerial, &state);
+    if (!SetCommState(hSerial, &state))
+        return FALSE;
 
     GetCommTimeouts(hSerial, &original_timeouts);
     timeouts = original_timeouts;
@@ -140,6 +146,28 @@ int serial_baud(unsigned long baud)
     return TRUE;
 }
 
+/**
+ * check whether a baud rate is supported
+ * @param baud - baud rate
+ * @returns 1 if supported and 0 if not
+ */
+int serial_baud_supported(unsigned long baud)
+{
+    switch (baud) {
+    case 9600:
+    case 19200:
+    case 38400:
+    case 57600:
+    case 115200:
+    case 230400:
+    case 460800:
+    case 921600:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
 void serial_done(void)
 {
     if (hSerial != INVALID_HANDLE_VALUE) {
@@ -204,6 +232,40 @@ int rx_timeout(uint8_t* buff, int n, int timeout)
     return dwBytes > 0 ? dwBytes : SERIAL_TIMEOUT;
 }
 
+/* post-reset delay */
+#define DEFAULT_RESET_DELAY 90
+static int reset_delay = DEFAULT_RESET_DELAY;
+
+/**
+ * set the delay after reset before the handshake begins
+ * @param ms - delay in milliseconds or -1 to use the default
+ */
+void set_reset_delay(int ms)
+{
+    reset_delay = ms < 0 ? DEFAULT_RESET_DELAY : ms;
+}
+
+/**
+ * get the delay after reset before the handshake begins
+ * @returns delay in milliseconds
+ */
+int get_reset_delay(void)
+{
+    return reset_delay;
+}
+
+/**
+ * get an identifier for the adapter connected to a port
+ * @param port - port name
+ * @param id - buffer for the identifier
+ * @param size - size of the buffer
+ * @returns 1 if a unique identifier was found and 0 otherwise
+ */
+int serial_id(const char *port, char *id, int size)
+{
+    return 0;
+}
+
 /**
  * hwreset ... resets Propeller hardware using DTR
  * @returns void
@@ -213,7 +275,7 @@ void hwreset(void)
     EscapeCommFunction(hSerial, reset_method == RESET_WITH_RTS ? SETRTS : SETDTR);
     Sleep(25);
     EscapeCommFunction(hSerial, reset_method == RESET_WITH_RTS ? CLRRTS : CLRDTR);
-    Sleep(90);
+    Sleep(reset_delay);
     // Purge here after reset helps to get rid of buffered data.
     PurgeComm(hSerial, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR);
 }
@@ -246,6 +308,48 @@ void msleep(int ms)
         ;
 }
 
+/**
+ * get the current time in milliseconds
+ * @returns time in milliseconds from an arbitrary starting point
+ */
+unsigned long msclock(void)
+{
+    return getms();
+}
+
+/* map_file - map an entire file into memory for reading */
+void *map_file(const char *name, long *pSize)
+{
+    HANDLE file, mapping;
+    DWORD size;
+    void *addr;
+
+    file = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    if ((size = GetFileSize(file, NULL)) == INVALID_FILE_SIZE || size == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return NULL;
+    addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!addr)
+        return NULL;
+
+    *pSize = (long)size;
+    return addr;
+}
+
+/* unmap_file - release a file mapped by map_file */
+void unmap_file(void *addr, long size)
+{
+    UnmapViewOfFile(addr);
+}
+
 static void ShowLastError(void)
 {
     LPVOID lpMsgBuf;
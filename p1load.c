@@ -4,8 +4,13 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#if defined(LINUX) || defined(MACOSX)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 #include "port.h"
 #include "ploader.h"
+#include "helper.h"
 #include "osint.h"
 
 #ifndef TRUE
@@ -31,12 +36,61 @@
 /* defaults */
 #define BAUD_RATE       115200
 
-/* constants */
-#define HUB_MEMORY_SIZE 32768
+/* image preparation status codes */
+enum {
+    IMAGE_OK,
+    IMAGE_NO_MEMORY
+};
+
+/* image preparation state - filled in by PrepareImage */
+typedef struct {
+    int trim;
+    uint8_t *image;
+    long imageSize;
+    long loadSize;
+    uint8_t *wire;
+    int wireSize;
+    int status;
+} ImageInfo;
+
+/* helper options */
+typedef struct {
+    int use;
+    int compress;
+    int differential;
+    char *file;
+    int maxBaud;
+    int busFreq;
+    int pageSize;
+    char *testFile;
+    uint8_t *testImage;
+    long testImageSize;
+    int testTimeout;
+    HL_bridge bridges[BRIDGE_MAX];
+    int bridgeCount;
+    int bridgeBaud;
+    int bridgeSimulate;
+    int xmem;
+    uint32_t xmemAddr;
+    int xmemPins[4];
+} HelperOptions;
+
+/* default milliseconds to wait for a test image to finish */
+#define DEFAULT_TEST_TIMEOUT    10000
+
+/* milliseconds allowed for a bridge load on top of sending the image (three acknowledgements of up to 5s) */
+#define BRIDGE_ACK_ALLOWANCE    16000
 
 static PL_state state;
 
 static void Usage(void);
+static void *PrepareImage(void *data);
+static int LoadImage(ImageInfo *info, int loadType, HelperOptions *helperOptions, int verbose);
+static int LoadWithHelper(ImageInfo *info, int loadType, HelperOptions *helperOptions, int verbose);
+static int RunTestImage(HelperOptions *helperOptions);
+static int LoadThroughBridge(ImageInfo *info, int loadType, HelperOptions *helperOptions, int verbose);
+static const char *BridgeStatus(int status);
+static int WriteExternalMemory(char *file, HelperOptions *helperOptions, int verbose);
 static uint8_t *ReadEntireFile(char *name, long *pSize);
 
 int main(int argc, char *argv[])
@@ -45,12 +99,36 @@ int main(int argc, char *argv[])
     int baudRate, baudRate2, verbose, terminalMode, pstMode, i;
     int loadType = LOAD_TYPE_RUN;
     int loadTypeOptionSeen = FALSE;
+    int trimImage = FALSE;
+    int calibrate = FALSE;
+    int probeBaud = FALSE;
+    HelperOptions helperOptions;
     int actionSpecified = FALSE;
     char *file = NULL;
-    long imageSize;
-    uint8_t *image;
+    ImageInfo info;
+#ifdef USE_THREADS
+    pthread_t prepareThread;
+    int threadStarted = FALSE;
+#endif
     
     /* initialize */
+    helperOptions.use = FALSE;
+    helperOptions.compress = FALSE;
+    helperOptions.differential = FALSE;
+    helperOptions.file = HL_FindHelper(argv[0]);
+    helperOptions.maxBaud = INT_MAX;
+    helperOptions.busFreq = EEPROM_BUS_FREQ;
+    helperOptions.pageSize = EEPROM_PAGE_SIZE;
+    helperOptions.testFile = NULL;
+    helperOptions.testImage = NULL;
+    helperOptions.testImageSize = 0;
+    helperOptions.testTimeout = DEFAULT_TEST_TIMEOUT;
+    helperOptions.bridgeCount = 0;
+    helperOptions.bridgeBaud = BaudRate;
+    helperOptions.bridgeSimulate = FALSE;
+    helperOptions.xmem = FALSE;
+    helperOptions.xmemAddr = 0;
+    helperOptions.xmemPins[0] = -1;
     baudRate = baudRate2 = BAUD_RATE;
     verbose = terminalMode = pstMode = FALSE;
     port = NULL;
@@ -78,6 +156,29 @@ int main(int argc, char *argv[])
                         baudRate2 = atoi(p);
                 }
                 break;
+            case 'B':
+                if (argv[i][2])
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    Usage();
+                if (helperOptions.bridgeCount >= BRIDGE_MAX) {
+                    printf("error: too many bridged chips - the limit is %d\n", BRIDGE_MAX);
+                    return 1;
+                }
+                else {
+                    HL_bridge *bridge = &helperOptions.bridges[helperOptions.bridgeCount];
+                    if (sscanf(p, "%d,%d,%d", &bridge->resetPin, &bridge->rxPin, &bridge->txPin) != 3)
+                        Usage();
+                    ++helperOptions.bridgeCount;
+                }
+                helperOptions.use = TRUE;
+                break;
+            case 'C':
+                calibrate = TRUE;
+                actionSpecified = TRUE;
+                break;
             case 'D':
                 if (argv[i][2])
                     p = &argv[i][2];
@@ -89,6 +190,35 @@ int main(int argc, char *argv[])
                     if ((val = strtok(NULL, "")) != NULL) {
                         if (strcmp(var, "reset") == 0)
                             use_reset_method(val);
+                        else if (strcmp(var, "helper") == 0)
+                            helperOptions.file = val;
+                        else if (strcmp(var, "maxbaud") == 0)
+                            helperOptions.maxBaud = atoi(val);
+                        else if (strcmp(var, "i2cfreq") == 0)
+                            helperOptions.busFreq = atoi(val);
+                        else if (strcmp(var, "pagesize") == 0)
+                            helperOptions.pageSize = atoi(val);
+                        else if (strcmp(var, "testtimeout") == 0)
+                            helperOptions.testTimeout = atoi(val);
+                        else if (strcmp(var, "bridgebaud") == 0)
+                            helperOptions.bridgeBaud = atoi(val);
+                        else if (strcmp(var, "bridgesim") == 0)
+                            helperOptions.bridgeSimulate = atoi(val) != 0;
+                        else if (strcmp(var, "xmempins") == 0) {
+                            int *pins = helperOptions.xmemPins;
+                            if (sscanf(val, "%d,%d,%d,%d", &pins[0], &pins[1], &pins[2], &pins[3]) != 4)
+                                Usage();
+                        }
+                        else if (strcmp(var, "margin") == 0)
+                            state.timeoutMargin = atoi(val);
+                        else if (strcmp(var, "packettrace") == 0)
+                            SetPacketTrace(atoi(val));
+                        else if (strcmp(var, "resetdelay") == 0) {
+                            int delay = atoi(val);
+                            if (delay > MaxResetDelay)
+                                delay = MaxResetDelay;
+                            SetResetDelay(delay);
+                        }
                         else
                             Usage();
                     }
@@ -98,6 +228,10 @@ int main(int argc, char *argv[])
                 else
                     Usage();
                 break;
+            case 'F':
+                probeBaud = TRUE;
+                actionSpecified = TRUE;
+                break;
             case 'e':
                 if (!loadTypeOptionSeen) {
                     loadTypeOptionSeen = TRUE;
@@ -105,6 +239,19 @@ int main(int argc, char *argv[])
                 }
                 loadType |= LOAD_TYPE_EEPROM;
                 break;
+            case 'f':
+                helperOptions.use = TRUE;
+                break;
+            case 'm':
+                if (argv[i][2])
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    Usage();
+                helperOptions.xmemAddr = (uint32_t)strtoul(p, NULL, 0);
+                helperOptions.use = helperOptions.xmem = TRUE;
+                break;
             case 'p':
                 if (argv[i][2])
                     port = &argv[i][2];
@@ -145,6 +292,9 @@ int main(int argc, char *argv[])
                 }
                 loadType |= LOAD_TYPE_RUN;
                 break;
+            case 's':
+                trimImage = TRUE;
+                break;
             case 'T':
                 pstMode = TRUE;
                 // fall through
@@ -152,9 +302,24 @@ int main(int argc, char *argv[])
                 terminalMode = TRUE;
                 actionSpecified = TRUE;
                 break;
+            case 'u':
+                helperOptions.use = helperOptions.differential = TRUE;
+                break;
             case 'v':
                 verbose = TRUE;
                 break;
+            case 'x':
+                if (argv[i][2])
+                    helperOptions.testFile = &argv[i][2];
+                else if (++i < argc)
+                    helperOptions.testFile = argv[i];
+                else
+                    Usage();
+                helperOptions.use = TRUE;
+                break;
+            case 'z':
+                helperOptions.use = helperOptions.compress = TRUE;
+                break;
             case '?':
                 /* fall through */
             default:
@@ -177,9 +342,76 @@ int main(int argc, char *argv[])
         printf("error: must specify either a file to load or -t\n");
         return 1;
     }
+    
+    /* the file is loaded into the bridged chips instead of the one on the port */
+    if (helperOptions.bridgeCount > 0 && (!file || helperOptions.testFile)) {
+        printf("error: -B needs a file to load and can't be used with -x\n");
+        return 1;
+    }
+    
+    /* the file is written to external memory instead of being loaded */
+    if (helperOptions.xmem) {
+        if (!file || helperOptions.testFile || helperOptions.bridgeCount > 0) {
+            printf("error: -m needs a file to write and can't be used with -x or -B\n");
+            return 1;
+        }
+        if (helperOptions.xmemPins[0] < 0) {
+            printf("error: -m needs the flash pins given with -Dxmempins=cs,clk,mosi,miso\n");
+            return 1;
+        }
+        if (helperOptions.xmemAddr % XMEM_SECTOR_SIZE != 0) {
+            printf("error: -m address must be a multiple of %d\n", XMEM_SECTOR_SIZE);
+            return 1;
+        }
+    }
+    
+    /* a test image is run ahead of loading a file */
+    if (helperOptions.testFile && !file) {
+        printf("error: -x needs a file to load after the test\n");
+        return 1;
+    }
+    
+    /* read and check the test image before touching the hardware */
+    if (helperOptions.testFile) {
+        int sts;
+        if (!(helperOptions.testImage = ReadEntireFile(helperOptions.testFile, &helperOptions.testImageSize))) {
+            printf("error: reading '%s'\n", helperOptions.testFile);
+            return 1;
+        }
+        if ((sts = PL_ValidateSpinBinary(helperOptions.testImage, helperOptions.testImageSize)) != SPIN_IMAGE_OK) {
+            printf("error: %s: %s\n", helperOptions.testFile, PL_SpinImageError(sts));
+            return 1;
+        }
+    }
+        
+    /* read and check the image before touching the hardware */
+    if (file && !helperOptions.xmem) {
+        int sts;
+        memset(&info, 0, sizeof(info));
+        info.trim = trimImage;
+        
+        /* read the entire file into a buffer */
+        if (!(info.image = ReadEntireFile(file, &info.imageSize))) {
+            printf("error: reading '%s'\n", file);
+            return 1;
+        }
         
+        /* make sure the image is loadable */
+        if ((sts = PL_ValidateSpinBinary(info.image, info.imageSize)) != SPIN_IMAGE_OK) {
+            printf("error: %s\n", PL_SpinImageError(sts));
+            return 1;
+        }
+        
+        /* encode the image while the port is opened and the chip is reset */
+#ifdef USE_THREADS
+        threadStarted = pthread_create(&prepareThread, NULL, PrepareImage, &info) == 0;
+        if (!threadStarted)
+#endif
+            PrepareImage(&info);
+    }
+    
     /* open the serial port */
-    if (file || terminalMode) {
+    if (file || terminalMode || calibrate || probeBaud) {
         switch (InitPort(&state, PORT_PREFIX, port, baudRate, verbose, actualPort)) {
         case CHECK_PORT_OK:
             printf("Found propeller version %d on %s\n", state.version, actualPort);
@@ -197,24 +429,69 @@ int main(int argc, char *argv[])
         }
     }
     
-    /* check for a file to load */
-    if (file) {
+    /* find the shortest reliable post-reset delay for this adapter */
+    if (calibrate) {
+        int delay;
+        printf("Calibrating reset delay ... ");
+        fflush(stdout);
+        if ((delay = CalibrateResetDelay(&state, actualPort, verbose)) < 0) {
+            printf("Failed\n");
+            return 1;
+        }
+        printf("%d ms\n", delay);
+    }
     
-        /* read the entire file into a buffer */
-        if (!(image = ReadEntireFile(file, &imageSize))) {
-            printf("error: reading '%s'\n", file);
+    /* find the fastest baud rate the helper can use without errors on this adapter */
+    if (probeBaud) {
+        uint8_t *helper;
+        long helperSize;
+        int baud;
+        if (!(helper = ReadEntireFile(helperOptions.file, &helperSize))) {
+            printf("error: reading '%s'\n", helperOptions.file);
             return 1;
         }
-        
-        /* make sure the file isn't too big for hub memory */
-        if (imageSize > HUB_MEMORY_SIZE) {
-            printf("error: image too big for hub memory\n");
+        printf("Probing helper baud rates ... ");
+        fflush(stdout);
+        if (verbose)
+            printf("\n");
+        baud = ProbeMaxBaud(&state, actualPort, helper, helperSize, helperOptions.maxBaud, verbose);
+        free(helper);
+        if (baud < 0) {
+            printf("Failed\n");
+            return 1;
+        }
+        printf("%d baud\n", baud);
+    }
+    
+    /* start the helper at the rate saved for the adapter by -F unless limited with -Dmaxbaud */
+    if (helperOptions.use && helperOptions.maxBaud == INT_MAX)
+        GetAdapterMaxBaud(actualPort, &helperOptions.maxBaud);
+    
+    /* write a file of any size to external memory */
+    if (helperOptions.xmem) {
+        if (WriteExternalMemory(file, &helperOptions, verbose) != LOAD_STS_OK)
+            return 1;
+    }
+    
+    /* check for a file to load */
+    else if (file) {
+    
+        /* wait for the image to be ready */
+#ifdef USE_THREADS
+        if (threadStarted)
+            pthread_join(prepareThread, NULL);
+#endif
+        if (info.status != IMAGE_OK) {
+            printf("error: insufficient memory\n");
             return 1;
         }
         
-        /* load the file from the memory buffer */
-        printf("Loading '%s' (%ld bytes)\n", file, imageSize);
-        switch (PL_LoadSpinBinary(&state, loadType, image, imageSize)) {
+        /* load the file from the encoded image */
+        if (info.loadSize < info.imageSize)
+            printf("Loading '%s' (%ld of %ld bytes)\n", file, info.loadSize, info.imageSize);
+        else
+            printf("Loading '%s' (%ld bytes)\n", file, info.imageSize);
+        switch (LoadImage(&info, loadType, &helperOptions, verbose)) {
         case LOAD_STS_OK:
             printf("OK\n");
             break;
@@ -249,14 +526,23 @@ printf("\
 p1load - a simple loader for the propeller - %s, %s\n\
 usage: p1load\n\
          [ -b baud ]               baud rate (default is %d)\n\
+         [ -B reset,rx,tx ]        load the file into a chip on these helper pins (repeat for more chips)\n\
+         [ -C ]                    calibrate and save the post-reset delay for the adapter\n\
          [ -D var=val ]            set variable value\n\
          [ -e ]                    write a bootable image to EEPROM\n\
+         [ -f ]                    load or write EEPROM through a helper at a higher baud rate\n\
+         [ -F ]                    probe and save the fastest reliable helper baud rate for the adapter\n\
+         [ -m addr ]               write the file to external flash at addr through the helper\n\
          [ -p port ]               serial port (default is to auto-detect the port)\n\
          [ -P ]                    list available serial ports\n\
          [ -r ]                    run the program after loading (default)\n\
+         [ -s ]                    only send the code and data part of the image\n\
          [ -t ]                    enter terminal mode after running the program\n\
          [ -T ]                    enter PST-compatible terminal mode\n\
+         [ -u ]                    like -f but only write the EEPROM pages that changed\n\
          [ -v ]                    verbose output\n\
+         [ -x testfile ]           run a test image through the helper first and only load if it passes\n\
+         [ -z ]                    like -f but run length encode the image\n\
          [ -? ]                    display a usage message and exit\n\
          file                      file to load\n", VERSION, __DATE__, BAUD_RATE);
 #ifdef RASPBERRY_PI
@@ -267,9 +553,302 @@ where \"pin\" is the GPIO number to use and \"level\" is the logic level, 0 or 1
 GPIO 17 and level 0.\n\
 ");
 #endif
+printf("\
+\n\
+The helper used by -f is read from '%s' in the current directory or the\n\
+directory of p1load (where make helper puts it) unless another file is given with\n\
+option: -Dhelper=file. The helper baud rate can be limited with option: -Dmaxbaud=baud.\n\
+Otherwise the fastest rate saved for the adapter by -F is used.\n\
+With -e the helper only writes the used EEPROM pages with the i2c bus at %d Hz and\n\
+%d byte pages unless changed with options: -Di2cfreq=hz and -Dpagesize=bytes.\n\
+\n\
+The post-reset delay can be set in milliseconds with option: -Dresetdelay=ms. Otherwise\n\
+the delay saved for the adapter by -C is used.\n\
+\n\
+Load timeouts are computed from the baud rate and image size plus a margin that can be\n\
+set in milliseconds with option: -Dmargin=ms. This defaults to %d.\n\
+\n\
+Helper packets can be traced with option: -Dpackettrace=level where level 1 shows each\n\
+packet sent or received and why any was rejected and level 2 adds every receive stage.\n\
+\n\
+A test run by -x passes when its first method returns 1. It must finish within the\n\
+time set in milliseconds with option: -Dtesttimeout=ms. This defaults to %d.\n\
+\n\
+With -B up to %d chips are loaded at the same time by the helper with pulses timed like\n\
+the ROM loader's at %d baud unless changed with option: -Dbridgebaud=baud. Option\n\
+-Dbridgesim=1 answers each bridge with a simulated ROM on its pins instead of a chip.\n\
+\n\
+With -m the file can be any size. The flash pins are given with option:\n\
+-Dxmempins=cs,clk,mosi,miso and the address must be a multiple of %d.\n\
+", HELPER_FILE, EEPROM_BUS_FREQ, EEPROM_PAGE_SIZE, DefaultTimeoutMargin, DEFAULT_TEST_TIMEOUT,
+   BRIDGE_MAX, BaudRate, XMEM_SECTOR_SIZE);
     exit(1);
 }
 
+/* LoadImage - load an image through the helper if requested and fall back to the rom loader */
+static int LoadImage(ImageInfo *info, int loadType, HelperOptions *helperOptions, int verbose)
+{
+    int sts;
+    
+    /* chips behind the helper can only be loaded through it */
+    if (helperOptions->bridgeCount > 0)
+        return LoadThroughBridge(info, loadType, helperOptions, verbose);
+    
+    if (helperOptions->use) {
+        if ((sts = LoadWithHelper(info, loadType, helperOptions, verbose)) == LOAD_STS_OK)
+            return sts;
+        
+        /* the rom loader can't run the test so a failed chain stops here */
+        if (helperOptions->testFile)
+            return sts;
+        
+        /* reset the chip and fall back to the rom loader */
+        printf("Helper load failed, using the ROM loader\n");
+        if ((sts = PL_HardwareFound(&state, &state.version)) != LOAD_STS_OK)
+            return sts;
+    }
+    
+    /* load the image with the rom loader */
+    if ((sts = PL_LoadEncodedSpinBinary(&state, loadType, info->wire, info->wireSize)) == LOAD_STS_OK && verbose)
+        printf("Acknowledged %d ms after the last phase started\n", state.ackLatency);
+    return sts;
+}
+
+/* LoadWithHelper - load an image into hub memory or write it to eeprom through the helper */
+static int LoadWithHelper(ImageInfo *info, int loadType, HelperOptions *helperOptions, int verbose)
+{
+    HL_stats stats;
+    uint8_t *helper;
+    long helperSize;
+    int sts;
+    
+    if (!(helper = ReadEntireFile(helperOptions->file, &helperSize))) {
+        printf("error: reading '%s'\n", helperOptions->file);
+        return LOAD_STS_ERROR;
+    }
+    
+    /* start the helper once for the whole chain of jobs */
+    sts = HL_StartHelper(&state, helper, helperSize, info->image, helperOptions->maxBaud);
+    free(helper);
+    if (sts != LOAD_STS_OK)
+        return sts;
+    
+    /* run the test image first and only go on if it passes */
+    if (helperOptions->testImage && (sts = RunTestImage(helperOptions)) != LOAD_STS_OK) {
+        HL_StopHelper(&state);
+        return sts;
+    }
+    
+    /* write the image to eeprom and reset the chip to boot it if it should run or otherwise
+       shut it down like the rom loader does */
+    if (loadType & LOAD_TYPE_EEPROM) {
+        if ((sts = HL_ConfigEEPROM(helperOptions->busFreq, helperOptions->pageSize)) == LOAD_STS_OK)
+            sts = HL_WriteEEPROMImage(info->image, info->imageSize, helperOptions->differential);
+        if (sts == LOAD_STS_OK && !(loadType & LOAD_TYPE_RUN))
+            sts = HL_Shutdown();
+        HL_StopHelper(&state);
+        if (sts == LOAD_STS_OK && (loadType & LOAD_TYPE_RUN))
+            (*state.reset)(state.serialData);
+    }
+    
+    /* load the image into hub memory */
+    else {
+        sts = HL_SendImage(info->image, info->loadSize, helperOptions->compress);
+        HL_StopHelper(&state);
+    }
+    
+    if (sts == LOAD_STS_OK && verbose) {
+        HL_GetStats(&stats);
+        printf("Loaded through the helper at %d baud\n", stats.baudRate);
+        printf("Sent %d bytes for %d bytes of image (%d%%) in %d ms",
+               stats.sentSize, stats.imageSize,
+               stats.imageSize ? (100 * stats.sentSize) / stats.imageSize : 0,
+               stats.elapsed);
+        if (stats.elapsed > 0) {
+            long rate = (1000L * stats.imageSize) / stats.elapsed;
+            long lineRate = stats.baudRate / 10;   /* a start bit, 8 data bits and a stop bit */
+            printf(" - %ld bytes/second effective (%ld%% of the %ld bytes/second line rate)",
+                   rate, (100 * rate) / lineRate, lineRate);
+        }
+        printf("\n");
+        if (stats.skippedSize > 0)
+            printf("Skipped %d bytes of EEPROM that already matched\n", stats.skippedSize);
+    }
+    
+    return sts;
+}
+
+/* LoadThroughBridge - load an image into each chip on the helper's pins at the same time */
+static int LoadThroughBridge(ImageInfo *info, int loadType, HelperOptions *helperOptions, int verbose)
+{
+    HL_bridge *bridge;
+    uint8_t *helper;
+    long helperSize;
+    int timeout, sts, i;
+    
+    if (!(helper = ReadEntireFile(helperOptions->file, &helperSize))) {
+        printf("error: reading '%s'\n", helperOptions->file);
+        return LOAD_STS_ERROR;
+    }
+    
+    /* the helper keeps its own clock settings since the image is for the other chips */
+    sts = HL_StartHelper(&state, helper, helperSize, NULL, helperOptions->maxBaud);
+    free(helper);
+    if (sts != LOAD_STS_OK)
+        return sts;
+    
+    /* allow three bit times per bit of the image plus the acknowledgements */
+    timeout = (int)((info->loadSize / 4) * 32 * 3 * 1000LL / helperOptions->bridgeBaud) + BRIDGE_ACK_ALLOWANCE;
+    sts = HL_BridgeLoad(info->image, info->imageSize, loadType, helperOptions->bridges, helperOptions->bridgeCount,
+                        helperOptions->bridgeBaud, helperOptions->bridgeSimulate, timeout);
+    HL_StopHelper(&state);
+    
+    /* show how each chip did */
+    for (i = 0; i < helperOptions->bridgeCount; ++i) {
+        bridge = &helperOptions->bridges[i];
+        printf("Chip on pins %d,%d,%d: %s", bridge->resetPin, bridge->rxPin, bridge->txPin, BridgeStatus(bridge->status));
+        if (bridge->version)
+            printf(" (version %d)", bridge->version);
+        printf("\n");
+    }
+    
+    if (verbose) {
+        HL_stats stats;
+        HL_GetStats(&stats);
+        printf("Sent %d bytes to the helper at %d baud and loaded %d chips in %d ms\n",
+               stats.sentSize, stats.baudRate, helperOptions->bridgeCount, stats.elapsed);
+    }
+    
+    return sts;
+}
+
+/* WriteExternalMemory - stream a file of any size to external flash through the helper */
+static int WriteExternalMemory(char *file, HelperOptions *helperOptions, int verbose)
+{
+    int *pins = helperOptions->xmemPins;
+    long helperSize, size;
+    uint8_t *helper, *data;
+    uint32_t id;
+    int sts;
+    
+    /* map the file rather than reading it since it can be much larger than hub memory */
+    if (!(data = (uint8_t *)map_file(file, &size))) {
+        printf("error: reading '%s'\n", file);
+        return LOAD_STS_ERROR;
+    }
+    
+    if (!(helper = ReadEntireFile(helperOptions->file, &helperSize))) {
+        printf("error: reading '%s'\n", helperOptions->file);
+        unmap_file(data, size);
+        return LOAD_STS_ERROR;
+    }
+    
+    /* the helper keeps its own clock settings since the file isn't a spin image */
+    sts = HL_StartHelper(&state, helper, helperSize, NULL, helperOptions->maxBaud);
+    free(helper);
+    if (sts == LOAD_STS_OK) {
+        if ((sts = HL_ConfigXMem(pins[0], pins[1], pins[2], pins[3], &id)) != LOAD_STS_OK)
+            printf("error: starting the flash driver\n");
+        else if ((id & 0xffffff) == 0 || (id & 0xffffff) == 0xffffff) {
+            printf("error: no flash found on pins %d,%d,%d,%d\n", pins[0], pins[1], pins[2], pins[3]);
+            sts = LOAD_STS_ERROR;
+        }
+        else {
+            if (verbose)
+                printf("Found flash with JEDEC id %06x\n", id & 0xffffff);
+            printf("Writing '%s' (%ld bytes) to external memory at 0x%x ... ", file, size, helperOptions->xmemAddr);
+            fflush(stdout);
+            sts = HL_WriteXMem(helperOptions->xmemAddr, data, (int)size);
+            printf("%s\n", sts == LOAD_STS_OK ? "OK" : "Error");
+        }
+        HL_StopHelper(&state);
+    }
+    unmap_file(data, size);
+    
+    if (sts == LOAD_STS_OK && verbose) {
+        HL_stats stats;
+        HL_GetStats(&stats);
+        printf("Wrote %d bytes in %d ms at %d baud", stats.imageSize, stats.elapsed, stats.baudRate);
+        if (stats.elapsed > 0)
+            printf(" - %ld bytes/second", (1000L * stats.imageSize) / stats.elapsed);
+        printf("\n");
+    }
+    
+    return sts;
+}
+
+/* BridgeStatus - describe the result of a bridge load */
+static const char *BridgeStatus(int status)
+{
+    switch (status) {
+    case BRIDGE_STS_BUSY:
+        return "still loading";
+    case BRIDGE_STS_OK:
+        return "OK";
+    case BRIDGE_STS_NO_PROPELLER:
+        return "no propeller";
+    case BRIDGE_STS_TIMEOUT:
+        return "timeout";
+    case BRIDGE_STS_ERROR:
+        return "load failed";
+    default:
+        return "unknown status";
+    }
+}
+
+/* RunTestImage - run the test image on the resident helper and check that it passed */
+static int RunTestImage(HelperOptions *helperOptions)
+{
+    uint32_t result;
+    int sts;
+    
+    printf("Running test '%s' ... ", helperOptions->testFile);
+    fflush(stdout);
+    if ((sts = HL_RunImage(helperOptions->testImage, helperOptions->testImageSize)) == LOAD_STS_OK)
+        sts = HL_WaitForResult(helperOptions->testTimeout, &result);
+    
+    /* always stop the test so it can't interfere with the next job */
+    if (HL_StopImage() != LOAD_STS_OK && sts == LOAD_STS_OK)
+        sts = LOAD_STS_ERROR;
+    
+    switch (sts) {
+    case LOAD_STS_OK:
+        if (result == 1) {
+            printf("Passed\n");
+            return LOAD_STS_OK;
+        }
+        printf("Failed with result %u\n", (unsigned)result);
+        return LOAD_STS_ERROR;
+    case LOAD_STS_TIMEOUT:
+        printf("Timeout\n");
+        break;
+    default:
+        printf("Error\n");
+        break;
+    }
+    
+    return sts;
+}
+
+/* PrepareImage - trim and encode an image */
+static void *PrepareImage(void *data)
+{
+    ImageInfo *info = (ImageInfo *)data;
+    
+    /* only send the part of the image that the rom loader needs */
+    info->loadSize = info->trim ? PL_SpinLoadSize(info->image, info->imageSize) : info->imageSize;
+    
+    /* encode the image in the rom loader wire format */
+    if (!(info->wire = (uint8_t *)malloc(PL_EncodedSize(info->loadSize)))) {
+        info->status = IMAGE_NO_MEMORY;
+        return NULL;
+    }
+    info->wireSize = PL_EncodeSpinBinary(info->image, info->loadSize, info->wire);
+    
+    info->status = IMAGE_OK;
+    return NULL;
+}
+
 /* ReadEntireFile - read an entire file into an allocated buffer */
 static uint8_t *ReadEntireFile(char *name, long *pSize)
 {
@@ -24,8 +24,26 @@
 
 /* protocol characters */
 #define SOH     0x01    /* start of a packet */
+#define PAD     0xff    /* idle byte sent ahead of a padded packet (has no falling edge after its start bit) */
 
-#define updcrc(crc, ch) (crctab[((crc) >> 8) & 0xff] ^ ((crc) << 8) ^ (ch))
+/* receive ring size (a power of two) - big enough for several frames from one read */
+#define RX_RING_SIZE    8192
+#define RX_RING_MASK    (RX_RING_SIZE - 1)
+
+/* milliseconds allowed for a whole frame to arrive */
+#define RX_TIMEOUT      1000
+
+/* frame parser states */
+#define RX_SOH      0   /* looking for the start of a frame */
+#define RX_HEADER   1   /* waiting for the rest of the header */
+#define RX_FRAME    2   /* waiting for the payload and the crc */
+
+/* ParseFrame results other than a payload length */
+#define RX_BAD      -1  /* the SOH of a damaged frame was dropped */
+#define RX_MORE     -2  /* more bytes are needed */
+
+/* print trace output at or below the level set by SetPacketTrace */
+#define TRACE(level, args)  do { if (traceLevel >= (level)) printf args; } while (0)
 
 static const uint16_t crctab[256] = {
     0x0000,  0x1021,  0x2042,  0x3063,  0x4084,  0x50a5,  0x60c6,  0x70e7,
@@ -62,95 +80,245 @@ static const uint16_t crctab[256] = {
     0x6e17,  0x7e36,  0x4e55,  0x5e74,  0x2e93,  0x3eb2,  0x0ed1,  0x1ef0
 };
 
+/* slice-by-8 tables - crctabs[k][b] is the crc of byte b followed by k zero bytes */
+static uint16_t crctabs[8][256];
+static int crctabsReady = 0;
+
+/* bytes read from the port but not yet parsed - rxHead and rxTail count bytes and are
+   masked to index the ring so that rxHead - rxTail is always the number of bytes held */
+static uint8_t rxRing[RX_RING_SIZE];
+static unsigned int rxHead = 0;
+static unsigned int rxTail = 0;
+
+/* trace level set by SetPacketTrace */
+static int traceLevel = PKT_TRACE_NONE;
+
+static int SendFrame(int type, uint8_t *buf, int len, int pad);
+static int FillRing(int timeout);
+static int ParseFrame(int *pState, int *pType, uint8_t *buf, int len);
+static void CopyFromRing(uint8_t *buf, int offset, int len);
+static void InitCrcTables(void);
+static uint16_t Crc16(uint8_t *buf, int len);
+
+void SetPacketTrace(int level)
+{
+    traceLevel = level;
+}
+
 int SendPacket(int type, uint8_t *buf, int len)
 {
-    uint8_t hdr[PKTHDRLEN], crc[PKTCRCLEN], *p;
-    uint16_t crc16 = 0;
-    int cnt;
+    return SendFrame(type, buf, len, 0);
+}
 
-    /* setup the frame header */
-    hdr[HDR_SOH] = SOH;                                 /* SOH */
-    hdr[HDR_TYPE] = type;                               /* type type */
-    hdr[HDR_LEN_HI] = (uint8_t)(len >> 8);              /* data length - high byte */
-    hdr[HDR_LEN_LO] = (uint8_t)len;                     /* data length - low byte */
-    hdr[HDR_CHK] = hdr[1] + hdr[2] + hdr[3];            /* header checksum */
-    printf("tx length %d\n", len);
-    printf("%02x %02x %02x\n", hdr[1], hdr[2], hdr[3]);
+int SendPaddedPacket(int type, uint8_t *buf, int len)
+{
+    return SendFrame(type, buf, len, 1);
+}
 
-    /* compute the crc */
-    for (p = buf, cnt = len; --cnt >= 0; ++p)
-        crc16 = updcrc(crc16, *p);
-    crc16 = updcrc(crc16, '\0');
-    crc16 = updcrc(crc16, '\0');
+int ReceivePacket(int *pType, uint8_t *buf, int len)
+{
+    unsigned long start = msclock();
+    int state = RX_SOH, damaged = 0, remaining, n;
 
-    /* add the crc to the frame */
-    crc[0] = (uint8_t)(crc16 >> 8);
-    crc[1] = (uint8_t)crc16;
+    /* parse what is already in the ring and read more until a frame is complete */
+    while ((n = ParseFrame(&state, pType, buf, len)) < 0) {
 
-    /* send the packet */
-    tx(hdr, PKTHDRLEN);
-    if (len > 0)
-        tx(buf, len);
-    tx(crc, PKTCRCLEN);
+        /* a good frame may follow a damaged one in the same read so report the damage only
+           once the ring runs dry */
+        if (n == RX_BAD)
+            damaged = 1;
+        else if (damaged)
+            return -1;
+        else {
+            remaining = RX_TIMEOUT - (int)(msclock() - start);
+            if (remaining <= 0 || !FillRing(remaining)) {
+                TRACE(PKT_TRACE_FRAMES, ("rx timeout with %d bytes pending\n", (int)(rxHead - rxTail)));
+                return -1;
+            }
+        }
+    }
 
-    return 0;
+    /* return the length of the payload */
+    return n;
 }
 
-int ReceivePacket(int *pType, uint8_t *buf, int len)
+void FlushPackets(void)
+{
+    rxTail = rxHead;
+}
+
+/* FillRing - read whatever has arrived into the free space at the head of the ring
+   returns the number of bytes read or zero if nothing arrived before the timeout */
+static int FillRing(int timeout)
+{
+    int offset = rxHead & RX_RING_MASK;
+    int space = RX_RING_SIZE - (int)(rxHead - rxTail);
+    int n;
+
+    /* the parser never holds more than one frame so this only drops unframed garbage */
+    if (space == 0) {
+        ++rxTail;
+        space = 1;
+    }
+
+    /* read up to the end of the ring and let the next read wrap around */
+    if (space > RX_RING_SIZE - offset)
+        space = RX_RING_SIZE - offset;
+    if ((n = rx_timeout(&rxRing[offset], space, timeout)) <= 0)
+        return 0;
+    rxHead += n;
+    TRACE(PKT_TRACE_ALL, ("rx read %d bytes (%d pending)\n", n, (int)(rxHead - rxTail)));
+
+    return n;
+}
+
+/* ParseFrame - advance the frame parser over the bytes in the ring
+   anything that isn't a good frame only drops its SOH so that an SOH in garbage whose header
+   happens to check can't swallow the real frame that follows it
+   returns the payload length of a good frame, RX_BAD for a damaged frame or RX_MORE */
+static int ParseFrame(int *pState, int *pType, uint8_t *buf, int len)
 {
     uint8_t hdr[PKTHDRLEN], crc[PKTCRCLEN];
-    int actual_len, chk;
-    uint16_t crc16 = 0;
-    int retries = 10;
-    printf("Looking for SOH\n");
+    int actual_len, chk, skipped;
 
-    /* look for start of packet */
-    do {
-        rx_timeout(&hdr[HDR_SOH], 1, 100);
-    } while (hdr[HDR_SOH] != SOH && --retries >= 0);
-    printf(" retries %d\n", retries);
+    for (;;) {
+        switch (*pState) {
+        case RX_SOH:
+            for (skipped = 0; rxHead != rxTail && rxRing[rxTail & RX_RING_MASK] != SOH; ++skipped)
+                ++rxTail;
+            if (skipped > 0)
+                TRACE(PKT_TRACE_ALL, ("rx skipped %d bytes looking for SOH\n", skipped));
+            if (rxHead == rxTail)
+                return RX_MORE;
+            *pState = RX_HEADER;
+            break;
 
-    /* check for a timeout waiting for the packet */
-    if (retries < 0)
-        return -1;
-        
-    /* receive the rest of the header */
-    rx(&hdr[HDR_TYPE], PKTHDRLEN - 1);
-    printf("%02x %02x %02x %02x %02x\n", hdr[0], hdr[1], hdr[2], hdr[3], hdr[4]);
-
-    /* check the header checksum */
-    chk = (hdr[1] + hdr[2] + hdr[3]) & 0xff;
-    if (hdr[HDR_CHK] != chk)
-        return -1;
-    printf("checksum okay\n");
+        case RX_HEADER:
+            if (rxHead - rxTail < PKTHDRLEN)
+                return RX_MORE;
+            CopyFromRing(hdr, 0, PKTHDRLEN);
+            TRACE(PKT_TRACE_ALL, ("rx header %02x %02x %02x %02x %02x\n",
+                                  hdr[0], hdr[1], hdr[2], hdr[3], hdr[4]));
 
-    /* make sure the buffer is big enough for the payload */
-    actual_len = (hdr[HDR_LEN_HI] << 8) | hdr[HDR_LEN_LO];
-    printf("rx length %d\n", actual_len);
-    if (actual_len > len)
-        return -1;
-    printf("length okay\n");
-    
-    /* receive the packet payload */
-    rx(buf, actual_len);
+            /* a bad checksum or length means this SOH wasn't the start of a frame */
+            chk = (hdr[1] + hdr[2] + hdr[3]) & 0xff;
+            actual_len = (hdr[HDR_LEN_HI] << 8) | hdr[HDR_LEN_LO];
+            if (hdr[HDR_CHK] != chk || actual_len > PKTMAXLEN) {
+                TRACE(PKT_TRACE_FRAMES, ("rx bad header checksum %02x (expected %02x) or length %d\n",
+                                         hdr[HDR_CHK], chk, actual_len));
+                ++rxTail;
+                *pState = RX_SOH;
+                break;
+            }
+            *pState = RX_FRAME;
+            break;
 
-    /* compute the crc */
-    for (len = actual_len; --len >= 0; )
-        crc16 = updcrc(crc16, *buf++);
+        case RX_FRAME:
+            CopyFromRing(hdr, 0, PKTHDRLEN);
+            actual_len = (hdr[HDR_LEN_HI] << 8) | hdr[HDR_LEN_LO];
+            if (rxHead - rxTail < (unsigned int)(PKTHDRLEN + actual_len + PKTCRCLEN))
+                return RX_MORE;
+            *pState = RX_SOH;
 
-    /* receive the crc */
-    rx(crc, PKTCRCLEN);
+            /* make sure the buffer is big enough for the payload */
+            if (actual_len > len) {
+                TRACE(PKT_TRACE_FRAMES, ("rx length %d too long for a %d byte buffer\n", actual_len, len));
+                ++rxTail;
+                return RX_BAD;
+            }
 
-    /* check the crc */
-    crc16 = updcrc(crc16, crc[0]);
-    crc16 = updcrc(crc16, crc[1]);
-    if (crc16 != 0)
+            /* copy out the payload and check the crc */
+            CopyFromRing(buf, PKTHDRLEN, actual_len);
+            CopyFromRing(crc, PKTHDRLEN + actual_len, PKTCRCLEN);
+            if (Crc16(buf, actual_len) != ((crc[0] << 8) | crc[1])) {
+                TRACE(PKT_TRACE_FRAMES, ("rx type %02x length %d bad crc\n", hdr[HDR_TYPE], actual_len));
+                ++rxTail;
+                return RX_BAD;
+            }
+            rxTail += PKTHDRLEN + actual_len + PKTCRCLEN;
+            TRACE(PKT_TRACE_FRAMES, ("rx type %02x length %d\n", hdr[HDR_TYPE], actual_len));
+
+            /* return packet type and the length of the payload */
+            *pType = hdr[HDR_TYPE];
+            return actual_len;
+        }
+    }
+}
+
+/* CopyFromRing - copy bytes starting offset bytes past the tail of the ring */
+static void CopyFromRing(uint8_t *buf, int offset, int len)
+{
+    int start = (rxTail + offset) & RX_RING_MASK;
+    int first = RX_RING_SIZE - start;
+    if (first > len)
+        first = len;
+    memcpy(buf, &rxRing[start], first);
+    if (len > first)
+        memcpy(&buf[first], rxRing, len - first);
+}
+
+/* SendFrame - build a frame in one buffer, optionally after a PAD byte, and send it with a single write */
+static int SendFrame(int type, uint8_t *buf, int len, int pad)
+{
+    uint8_t frame[1 + FRAMELEN], *hdr = &frame[pad];
+    uint16_t crc16;
+    int size;
+
+    /* make sure the payload fits */
+    if (len < 0 || len > PKTMAXLEN)
         return -1;
-    printf("crc okay\n");
 
-    /* return packet type and the length of the payload */
-    *pType = hdr[HDR_TYPE];
-    return actual_len;
+    /* setup the frame header */
+    frame[0] = PAD;                                     /* overwritten by SOH without a pad */
+    hdr[HDR_SOH] = SOH;                                 /* SOH */
+    hdr[HDR_TYPE] = type;                               /* type type */
+    hdr[HDR_LEN_HI] = (uint8_t)(len >> 8);              /* data length - high byte */
+    hdr[HDR_LEN_LO] = (uint8_t)len;                     /* data length - low byte */
+    hdr[HDR_CHK] = hdr[1] + hdr[2] + hdr[3];            /* header checksum */
+
+    /* add the payload and the crc */
+    if (len > 0)
+        memcpy(&hdr[PKTHDRLEN], buf, len);
+    crc16 = Crc16(buf, len);
+    hdr[PKTHDRLEN + len] = (uint8_t)(crc16 >> 8);
+    hdr[PKTHDRLEN + len + 1] = (uint8_t)crc16;
+
+    /* send the packet */
+    TRACE(PKT_TRACE_FRAMES, ("tx type %02x length %d\n", type, len));
+    size = pad + PKTHDRLEN + len + PKTCRCLEN;
+    return tx(frame, size) == size ? 0 : -1;
+}
+
+/* InitCrcTables - extend crctab to the tables for eight bytes at a time */
+static void InitCrcTables(void)
+{
+    int i, k;
+    for (i = 0; i < 256; ++i) {
+        crctabs[0][i] = crctab[i];
+        for (k = 1; k < 8; ++k)
+            crctabs[k][i] = (uint16_t)((crctabs[k - 1][i] << 8) ^ crctab[crctabs[k - 1][i] >> 8]);
+    }
+    crctabsReady = 1;
+}
+
+/* Crc16 - compute the crc-ccitt of a buffer eight bytes at a time
+   this matches the byte at a time crc in packet_driver.spin run over the buffer and two zero bytes */
+static uint16_t Crc16(uint8_t *buf, int len)
+{
+    uint16_t crc16 = 0;
+    
+    if (!crctabsReady)
+        InitCrcTables();
+    
+    for (; len >= 8; buf += 8, len -= 8)
+        crc16 = crctabs[7][buf[0] ^ (crc16 >> 8)] ^ crctabs[6][buf[1] ^ (crc16 & 0xff)]
+              ^ crctabs[5][buf[2]] ^ crctabs[4][buf[3]] ^ crctabs[3][buf[4]]
+              ^ crctabs[2][buf[5]] ^ crctabs[1][buf[6]] ^ crctabs[0][buf[7]];
+    
+    while (--len >= 0)
+        crc16 = (uint16_t)((crc16 << 8) ^ crctab[(crc16 >> 8) ^ *buf++]);
+    
+    return crc16;
 }
 
 /*
@@ -26,7 +26,15 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 
 #define PKTMAXLEN   1024
 
+/* trace levels for SetPacketTrace */
+#define PKT_TRACE_NONE      0   /* no output (the default) */
+#define PKT_TRACE_FRAMES    1   /* the type and length of each frame and why any was rejected */
+#define PKT_TRACE_ALL       2   /* every receive stage */
+
 int SendPacket(int type, uint8_t *buf, int len);
+int SendPaddedPacket(int type, uint8_t *buf, int len);
 int ReceivePacket(int *pType, uint8_t *buf, int len);
+void FlushPackets(void);
+void SetPacketTrace(int level);
 
 #endif
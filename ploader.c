@@ -7,26 +7,56 @@
 #endif
 
 /* timeouts in milliseconds */
-#define ACK_TIMEOUT                 25
-#define CHECKSUM_TIMEOUT            10000   // big because it includes program loading
-#define EEPROM_PROGRAMMING_TIMEOUT  5000
-#define EEPROM_VERIFICATION_TIMEOUT 2000
+#define ACK_POLL_INTERVAL           5       // time between calibration bytes while waiting for an ack
+#define CHECKSUM_TIMEOUT            10000   // used when the baud rate is unknown
 
-#define CHECKSUM_RETRIES            (CHECKSUM_TIMEOUT / ACK_TIMEOUT)
-#define EEPROM_PROGRAMMING_RETRIES  (EEPROM_PROGRAMMING_TIMEOUT / ACK_TIMEOUT)
-#define EEPROM_VERIFICATION_RETRIES (EEPROM_VERIFICATION_TIMEOUT / ACK_TIMEOUT)
+/* rom loader timing used to compute the phase deadlines */
+#define CHECKSUM_ALLOWANCE          500     // time to clear hub memory and compute the checksum (in ms)
+#define EEPROM_SIZE                 32768   // the rom loader always writes the first 32k of the eeprom
+#define EEPROM_PAGE_SIZE            64
+#define EEPROM_PAGE_WRITE_TIME      8       // time to send and write one page (in ms)
+#define EEPROM_BYTE_VERIFY_TIME     50      // time to read back and compare one byte (in us)
 
-static int WaitForAck(PL_state *state, int retries);
+/* handshake lengths in bits */
+#define HANDSHAKE_LENGTH            250
+#define VERSION_LENGTH              8
+
+/* spin binary header offsets */
+#define SPIN_HDR_CLKFREQ            0
+#define SPIN_HDR_CLKMODE            4
+#define SPIN_HDR_CHECKSUM           5
+#define SPIN_HDR_PBASE              6
+#define SPIN_HDR_VBASE              8
+#define SPIN_HDR_DBASE              10
+#define SPIN_HDR_PCURR              12
+#define SPIN_HDR_DCURR              14
+#define SPIN_HDR_SIZE               16
+
+/* hub memory size */
+#define HUB_SIZE                    32768
+
+/* checksum contribution of the two stack frame longs ($fff9ffff) written by the rom loader */
+#define STACK_FRAME_CHECKSUM        0xec
+
+#define SpinWord(image, offset)     ((image)[offset] | ((image)[(offset) + 1] << 8))
+
+static int ValidClockMode(int mode);
+
+static void SetDeadlines(PL_state *state, int longCount);
+static int WaitForLoad(PL_state *state, int loadType);
+static int WaitForAck(PL_state *state, int timeout);
 static void SerialInit(PL_state *state);
 static void TByte(PL_state *state, uint8_t x);
 static void TLong(PL_state *state, uint32_t x);
+static void TImage(PL_state *state, uint8_t *image, int size);
+static uint8_t *EncodeLong(uint8_t *p, uint32_t x);
 static void TComm(PL_state *state);
-static int RBit(PL_state *state, int timeout);
-static int IterateLFSR(PL_state *state);
+static int RBits(PL_state *state, uint8_t *bits, int count, int timeout);
 
 void PL_Init(PL_state *state)
 {
     memset(state, 0, sizeof(PL_state));
+    state->timeoutMargin = DefaultTimeoutMargin;
 }
 
 /* PL_Shutdown - shutdown the loader */
@@ -39,8 +69,6 @@ void PL_Shutdown(PL_state *state)
 /* PL_LoadSpinBinary - load a spin binary using the rom loader */
 int PL_LoadSpinBinary(PL_state *state, int loadType, uint8_t *image, int size)
 {
-    int i, sts;
-    
     /* report the start of program loading */
     if (state->progress)
         (*state->progress)(state->progressData, LOAD_PHASE_PROGRAM);
@@ -49,14 +77,192 @@ int PL_LoadSpinBinary(PL_state *state, int loadType, uint8_t *image, int size)
     TLong(state, size / sizeof(uint32_t));
     
     /* download the spin binary */
+    TImage(state, image, size);
+    TComm(state);
+    
+    /* compute the deadlines for each phase of the load */
+    SetDeadlines(state, size / sizeof(uint32_t));
+    
+    /* wait for the load to complete */
+    return WaitForLoad(state, loadType);
+}
+
+/* PL_ValidateSpinBinary - check a spin binary before loading it */
+int PL_ValidateSpinBinary(uint8_t *image, int size)
+{
+    int pbase, vbase, dbase, pcurr, dcurr, chk, i;
+    uint32_t clkfreq;
+    
+    /* check the image size */
+    if (size < SPIN_HDR_SIZE)
+        return SPIN_IMAGE_TOO_SMALL;
+    if (size > HUB_SIZE)
+        return SPIN_IMAGE_TOO_BIG;
+    if ((size & 3) != 0)
+        return SPIN_IMAGE_NOT_LONG_ALIGNED;
+        
+    /* check the clock settings */
+    clkfreq = image[SPIN_HDR_CLKFREQ]
+            | (image[SPIN_HDR_CLKFREQ + 1] << 8)
+            | (image[SPIN_HDR_CLKFREQ + 2] << 16)
+            | ((uint32_t)image[SPIN_HDR_CLKFREQ + 3] << 24);
+    if (clkfreq == 0)
+        return SPIN_IMAGE_BAD_CLKFREQ;
+    if (!ValidClockMode(image[SPIN_HDR_CLKMODE]))
+        return SPIN_IMAGE_BAD_CLKMODE;
+        
+    /* check that the memory layout is consistent */
+    pbase = SpinWord(image, SPIN_HDR_PBASE);
+    vbase = SpinWord(image, SPIN_HDR_VBASE);
+    dbase = SpinWord(image, SPIN_HDR_DBASE);
+    pcurr = SpinWord(image, SPIN_HDR_PCURR);
+    dcurr = SpinWord(image, SPIN_HDR_DCURR);
+    if (pbase != SPIN_HDR_SIZE
+    ||  vbase < pbase || vbase > size || (vbase & 3) != 0
+    ||  dbase < vbase + 8 || (dbase & 3) != 0
+    ||  pcurr < pbase || pcurr >= vbase
+    ||  dcurr < dbase || dcurr > HUB_SIZE)
+        return SPIN_IMAGE_BAD_HEADER;
+        
+    /* the bytes of the image along with the stack frame written by the rom loader must sum to zero */
+    for (chk = STACK_FRAME_CHECKSUM, i = 0; i < size; ++i) {
+        if (i < dbase - 8 || i >= dbase)
+            chk += image[i];
+    }
+    if ((chk & 0xff) != 0)
+        return SPIN_IMAGE_BAD_CHECKSUM;
+        
+    /* image looks okay */
+    return SPIN_IMAGE_OK;
+}
+
+/* PL_SpinImageError - get a description of a spin image validation result */
+const char *PL_SpinImageError(int sts)
+{
+    switch (sts) {
+    case SPIN_IMAGE_OK:
+        return "image is okay";
+    case SPIN_IMAGE_TOO_SMALL:
+        return "image is too small to have a header";
+    case SPIN_IMAGE_TOO_BIG:
+        return "image too big for hub memory";
+    case SPIN_IMAGE_NOT_LONG_ALIGNED:
+        return "image size is not a multiple of four bytes";
+    case SPIN_IMAGE_BAD_CLKFREQ:
+        return "image has a zero clock frequency";
+    case SPIN_IMAGE_BAD_CLKMODE:
+        return "image has an invalid clock mode";
+    case SPIN_IMAGE_BAD_HEADER:
+        return "image header is inconsistent";
+    case SPIN_IMAGE_BAD_CHECKSUM:
+        return "image checksum is wrong";
+    default:
+        return "unknown image error";
+    }
+}
+
+/* ValidClockMode - check that a clock mode byte is a combination the hardware supports */
+static int ValidClockMode(int mode)
+{
+    int clksel = mode & 0x07;
+    if (mode & 0x80)                        // reset bit
+        return FALSE;
+    if (clksel < 2)                         // rcfast or rcslow with the oscillator and pll off
+        return mode == clksel;
+    if (clksel == 2)                        // xinput with the oscillator on and the pll off
+        return (mode & 0x67) == 0x22;
+    return (mode & 0x60) == 0x60;           // pll modes need both the oscillator and pll on
+}
+
+/* PL_SpinLoadSize - get the number of bytes of a spin binary that need to be loaded */
+int PL_SpinLoadSize(uint8_t *image, int size)
+{
+    int vbase, dbase, chk, i;
+    
+    /* make sure there is a header */
+    if (size < SPIN_HDR_SIZE)
+        return size;
+    
+    /* get the start of the variable and stack areas */
+    vbase = SpinWord(image, SPIN_HDR_VBASE);
+    dbase = SpinWord(image, SPIN_HDR_DBASE);
+    if (vbase < SPIN_HDR_SIZE || vbase > size || (vbase & 3) != 0)
+        return size;
+        
+    /* everything past vbase must be zero except for the initial stack frame */
+    for (i = vbase; i < size; ++i) {
+        if (i >= dbase - 8 && i < dbase)
+            continue;
+        if (image[i] != 0)
+            return size;
+    }
+    
+    /* make sure the checksum still works with the trimmed image */
+    for (chk = STACK_FRAME_CHECKSUM, i = 0; i < vbase; ++i)
+        chk += image[i];
+    if ((chk & 0xff) != 0)
+        return size;
+    
+    /* only the code and data need to be sent */
+    return vbase;
+}
+
+/* PL_EncodeSpinBinary - encode a spin binary into the rom loader wire format */
+int PL_EncodeSpinBinary(uint8_t *image, int size, uint8_t *wire)
+{
+    uint8_t *p = wire;
+    int i;
     for (i = 0; i < size; i += 4) {
-        uint32_t data = image[i] | (image[i + 1] << 8) | (image[i + 2] << 16) | (image[i + 3] << 24);
-        TLong(state, data);
+        uint32_t data = image[i] | (image[i + 1] << 8) | (image[i + 2] << 16) | ((uint32_t)image[i + 3] << 24);
+        p = EncodeLong(p, data);
     }
+    return p - wire;
+}
+
+/* PL_LoadEncodedSpinBinary - load a spin binary that has already been encoded */
+int PL_LoadEncodedSpinBinary(PL_state *state, int loadType, uint8_t *wire, int wireSize)
+{
+    /* report the start of program loading */
+    if (state->progress)
+        (*state->progress)(state->progressData, LOAD_PHASE_PROGRAM);
+    
+    TLong(state, loadType);
+    TLong(state, wireSize / BytesPerLong);
     TComm(state);
     
+    /* download the encoded spin binary */
+    (*state->tx)(state->serialData, wire, wireSize);
+    
+    /* compute the deadlines for each phase of the load */
+    SetDeadlines(state, wireSize / BytesPerLong);
+    
+    /* wait for the load to complete */
+    return WaitForLoad(state, loadType);
+}
+
+/* SetDeadlines - compute the phase deadlines from the number of bytes queued and the baud rate */
+static void SetDeadlines(PL_state *state, int longCount)
+{
+    int wireBytes = (longCount + 2) * BytesPerLong;
+    
+    /* the checksum ack can't arrive before the queued bytes have been sent at 10 bits per byte */
+    if (state->baudRate > 0)
+        state->checksumTimeout = (int)((wireBytes * 10000LL) / state->baudRate) + CHECKSUM_ALLOWANCE + state->timeoutMargin;
+    else
+        state->checksumTimeout = CHECKSUM_TIMEOUT;
+        
+    /* the eeprom phases depend only on the eeprom size */
+    state->eepromProgrammingTimeout = (EEPROM_SIZE / EEPROM_PAGE_SIZE) * EEPROM_PAGE_WRITE_TIME + state->timeoutMargin;
+    state->eepromVerificationTimeout = (EEPROM_SIZE / 1000) * EEPROM_BYTE_VERIFY_TIME + state->timeoutMargin;
+}
+
+/* WaitForLoad - wait for the rom loader to acknowledge each phase of the load */
+static int WaitForLoad(PL_state *state, int loadType)
+{
+    int sts;
+    
     /* wait for an ACK indicating a successful load */
-    if ((sts = WaitForAck(state, CHECKSUM_RETRIES)) < 0)
+    if ((sts = WaitForAck(state, state->checksumTimeout)) < 0)
         return LOAD_STS_TIMEOUT;
     else if (sts == 0)
         return LOAD_STS_ERROR;
@@ -69,7 +275,7 @@ int PL_LoadSpinBinary(PL_state *state, int loadType, uint8_t *image, int size)
             (*state->progress)(state->progressData, LOAD_PHASE_EEPROM_WRITE);
 
         /* wait for an ACK indicating a successful EEPROM programming */
-        if ((sts = WaitForAck(state, EEPROM_PROGRAMMING_RETRIES)) < 0)
+        if ((sts = WaitForAck(state, state->eepromProgrammingTimeout)) < 0)
             return LOAD_STS_TIMEOUT;
         else if (sts == 0)
             return LOAD_STS_ERROR;
@@ -79,7 +285,7 @@ int PL_LoadSpinBinary(PL_state *state, int loadType, uint8_t *image, int size)
             (*state->progress)(state->progressData, LOAD_PHASE_EEPROM_VERIFY);
 
         /* wait for an ACK indicating a successful EEPROM verification */
-        if ((sts = WaitForAck(state, EEPROM_VERIFICATION_RETRIES)) < 0)
+        if ((sts = WaitForAck(state, state->eepromVerificationTimeout)) < 0)
             return LOAD_STS_TIMEOUT;
         else if (sts == 0)
             return LOAD_STS_ERROR;
@@ -93,27 +299,74 @@ int PL_LoadSpinBinary(PL_state *state, int loadType, uint8_t *image, int size)
     return LOAD_STS_OK;
 }
 
-static int WaitForAck(PL_state *state, int retries)
+/* WaitForAck - send calibration bytes until the rom loader responds or the timeout expires */
+static int WaitForAck(PL_state *state, int timeout)
 {
+    unsigned long start = (*state->msclock)(state->serialData);
+    int elapsed;
     uint8_t buf[1];
-    while (--retries >= 0) {
-        (*state->msleep)(state->serialData, 20);
+    do {
         TByte(state, 0xf9);
         TComm(state);
-        if ((*state->rx_timeout)(state->serialData, buf, 1, ACK_TIMEOUT) > 0)
+        if ((*state->rx_timeout)(state->serialData, buf, 1, ACK_POLL_INTERVAL) > 0) {
+            state->ackLatency = (int)((*state->msclock)(state->serialData) - start);
             return buf[0] == 0xfe;
-    }
+        }
+        elapsed = (int)((*state->msclock)(state->serialData) - start);
+    } while (elapsed < timeout);
     return -1; // timeout
 }
 
 /* this code is adapted from Chip Gracey's PNut IDE */
 
+/* handshake pattern - the first 250 bits of the lfsr sequence seeded with 'P' each sent as 0xfe | bit */
+static const uint8_t handshakeTx[HANDSHAKE_LENGTH] = {
+    0xfe, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xfe,
+    0xfe, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xfe,
+    0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xfe,
+    0xff, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xff,
+    0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xff,
+    0xfe, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xfe,
+    0xff, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xff,
+    0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xfe,
+    0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xff,
+    0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xfe,
+    0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xfe,
+    0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xff
+};
+
+/* expected response - the next 250 bits of the lfsr sequence each received as 0xfe | bit */
+static const uint8_t handshakeRx[HANDSHAKE_LENGTH] = {
+    0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xff,
+    0xff, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xfe,
+    0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xff,
+    0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xfe,
+    0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xfe,
+    0xfe, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xfe,
+    0xff, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xfe, 0xff,
+    0xfe, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xfe,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xff,
+    0xff, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xfe,
+    0xff, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xfe, 0xfe,
+    0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xff,
+    0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xff,
+    0xff, 0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe,
+    0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff,
+    0xff, 0xfe, 0xff, 0xfe, 0xfe, 0xfe, 0xff, 0xfe, 0xff, 0xfe
+};
+
 int PL_HardwareFound(PL_state *state, int *pVersion)
 {
+    uint8_t bits[HANDSHAKE_LENGTH];
     int version, i;
         
     /* initialize the serial buffers */
     SerialInit(state);
+    state->handshakeErrorBit = -1;
     
     /* report the start of the handshake phase */
     if (state->progress)
@@ -126,13 +379,12 @@ int PL_HardwareFound(PL_state *state, int *pVersion)
     TByte(state, 0xf9);
     
     /* transmit the handshake pattern */
-    state->lfsr = 'P';
-    for (i = 0; i < 250; ++i)
-        TByte(state, IterateLFSR(state) | 0xfe);
+    memcpy(&state->txbuf[state->txcnt], handshakeTx, HANDSHAKE_LENGTH);
+    state->txcnt += HANDSHAKE_LENGTH;
 
     /* transmit calibration pulses to clock out the connection response and the version byte */
-    for (i = 0; i < 250 + 8; ++i)
-        TByte(state, 0xf9);
+    memset(&state->txbuf[state->txcnt], 0xf9, HANDSHAKE_LENGTH + VERSION_LENGTH);
+    state->txcnt += HANDSHAKE_LENGTH + VERSION_LENGTH;
         
     /* flush the transmit buffer */
     TComm(state);
@@ -142,12 +394,15 @@ int PL_HardwareFound(PL_state *state, int *pVersion)
         (*state->progress)(state->progressData, LOAD_PHASE_RESPONSE);
 
     /* receive the connection response */
-    for (i = 0; i < 250; ++i) {
-        int bit = RBit(state, 100);
-        if (bit < 0)
-            return LOAD_STS_TIMEOUT;
-        else if (bit != IterateLFSR(state))
-            return LOAD_STS_ERROR;
+    if (RBits(state, bits, HANDSHAKE_LENGTH, 100) < 0)
+        return LOAD_STS_TIMEOUT;
+        
+    /* compare it with the expected response */
+    if (memcmp(bits, handshakeRx, HANDSHAKE_LENGTH) != 0) {
+        for (i = 0; bits[i] == handshakeRx[i]; ++i)
+            ;
+        state->handshakeErrorBit = i;
+        return LOAD_STS_ERROR;
     }
         
     /* report the start of the version phase */
@@ -155,12 +410,10 @@ int PL_HardwareFound(PL_state *state, int *pVersion)
         (*state->progress)(state->progressData, LOAD_PHASE_VERSION);
 
     /* receive the chip version */
-    for (version = i = 0; i < 8; ++i) {
-        int bit = RBit(state, 50);
-        if (bit < 0)
-            return LOAD_STS_TIMEOUT;
-        version = ((version >> 1) & 0x7f) | (bit << 7);
-    }
+    if (RBits(state, bits, VERSION_LENGTH, 50) < 0)
+        return LOAD_STS_TIMEOUT;
+    for (version = i = 0; i < VERSION_LENGTH; ++i)
+        version = ((version >> 1) & 0x7f) | ((bits[i] & 1) << 7);
     *pVersion = version;
         
     /* report handshake completion */
@@ -187,33 +440,60 @@ static void TByte(PL_state *state, uint8_t x)
         TComm(state);
 }
 
+/* wire encoding of three bits of a long - 0x92 | bit0 | bit1 << 3 | bit2 << 6 */
+#define WIRE_BITS(b)    (0x92 | ((b) & 1) | (((b) & 2) << 2) | (((b) & 4) << 4))
+#define WIRE_PAIR(n)    { WIRE_BITS((n) & 7), WIRE_BITS((n) >> 3) }
+
+/* wire encoding of six bits of a long as a pair of bytes */
+static const uint8_t wirePairs[64][2] = {
+    WIRE_PAIR(0), WIRE_PAIR(1), WIRE_PAIR(2), WIRE_PAIR(3), WIRE_PAIR(4), WIRE_PAIR(5), WIRE_PAIR(6), WIRE_PAIR(7),
+    WIRE_PAIR(8), WIRE_PAIR(9), WIRE_PAIR(10), WIRE_PAIR(11), WIRE_PAIR(12), WIRE_PAIR(13), WIRE_PAIR(14), WIRE_PAIR(15),
+    WIRE_PAIR(16), WIRE_PAIR(17), WIRE_PAIR(18), WIRE_PAIR(19), WIRE_PAIR(20), WIRE_PAIR(21), WIRE_PAIR(22), WIRE_PAIR(23),
+    WIRE_PAIR(24), WIRE_PAIR(25), WIRE_PAIR(26), WIRE_PAIR(27), WIRE_PAIR(28), WIRE_PAIR(29), WIRE_PAIR(30), WIRE_PAIR(31),
+    WIRE_PAIR(32), WIRE_PAIR(33), WIRE_PAIR(34), WIRE_PAIR(35), WIRE_PAIR(36), WIRE_PAIR(37), WIRE_PAIR(38), WIRE_PAIR(39),
+    WIRE_PAIR(40), WIRE_PAIR(41), WIRE_PAIR(42), WIRE_PAIR(43), WIRE_PAIR(44), WIRE_PAIR(45), WIRE_PAIR(46), WIRE_PAIR(47),
+    WIRE_PAIR(48), WIRE_PAIR(49), WIRE_PAIR(50), WIRE_PAIR(51), WIRE_PAIR(52), WIRE_PAIR(53), WIRE_PAIR(54), WIRE_PAIR(55),
+    WIRE_PAIR(56), WIRE_PAIR(57), WIRE_PAIR(58), WIRE_PAIR(59), WIRE_PAIR(60), WIRE_PAIR(61), WIRE_PAIR(62), WIRE_PAIR(63)
+};
+
 /* TLong - add a long to the transmit buffer */
 static void TLong(PL_state *state, uint32_t x)
 {
-    int i;
-    for (i = 0; i < 11; ++i) {
-
-#if 0
-        // p2 code
-        uint8_t byte = 0x92
-                     | ((i == 10 ? -1 : 0) & 0x60)
-                     | ((x >> 31) & 1)
-                     | (((x >> 30) & 1) << 3)
-                     | (((x >> 29) & 1) << 6);
-        TByte(state, byte);
-        x <<= 3;
-#else
-        // p1 code
-        uint8_t byte = 0x92
-                     | ((i == 10 ? -1 : 0) & 0x60)
-                     |  (x & 1)
-                     | ((x & 2) << 2)
-                     | ((x & 4) << 4);
-        TByte(state, byte);
-        x >>= 3;
-#endif
+    if (state->txcnt + BytesPerLong > sizeof(state->txbuf))
+        TComm(state);
+    EncodeLong(&state->txbuf[state->txcnt], x);
+    state->txcnt += BytesPerLong;
+}
 
+/* TImage - add an image to the transmit buffer encoding it a long at a time */
+static void TImage(PL_state *state, uint8_t *image, int size)
+{
+    uint8_t *p = &state->txbuf[state->txcnt];
+    uint8_t *end = &state->txbuf[sizeof(state->txbuf) - BytesPerLong];
+    int i;
+    for (i = 0; i < size; i += 4) {
+        uint32_t data = image[i] | (image[i + 1] << 8) | (image[i + 2] << 16) | ((uint32_t)image[i + 3] << 24);
+        if (p > end) {
+            state->txcnt = p - state->txbuf;
+            TComm(state);
+            p = state->txbuf;
+        }
+        p = EncodeLong(p, data);
     }
+    state->txcnt = p - state->txbuf;
+}
+
+/* EncodeLong - encode a long as eleven bytes of three bits each (the last byte has two bits and the 0x60 terminator)
+   six bits at a time */
+static uint8_t *EncodeLong(uint8_t *p, uint32_t x)
+{
+    memcpy(&p[0], wirePairs[x & 0x3f], 2);
+    memcpy(&p[2], wirePairs[(x >> 6) & 0x3f], 2);
+    memcpy(&p[4], wirePairs[(x >> 12) & 0x3f], 2);
+    memcpy(&p[6], wirePairs[(x >> 18) & 0x3f], 2);
+    memcpy(&p[8], wirePairs[(x >> 24) & 0x3f], 2);
+    p[10] = wirePairs[x >> 30][0] | 0x60;
+    return p + BytesPerLong;
 }
 
 /* TComm - write the transmit buffer to the port */
@@ -223,11 +503,10 @@ static void TComm(PL_state *state)
     state->txcnt = 0;
 }
 
-/* RBit - receive a bit with a timeout */
-static int RBit(PL_state *state, int timeout)
+/* RBits - receive a sequence of bits sent as 0xfe or 0xff bytes with a timeout */
+static int RBits(PL_state *state, uint8_t *bits, int count, int timeout)
 {
-    int result;
-    for (;;) {
+    while (count > 0) {
         if (state->rxnext >= state->rxcnt) {
             state->rxcnt = (*state->rx_timeout)(state->serialData, state->rxbuf, sizeof(state->rxbuf), timeout);
             if (state->rxcnt <= 0) {
@@ -236,20 +515,16 @@ static int RBit(PL_state *state, int timeout)
             }
             state->rxnext = 0;
         }
-        result = state->rxbuf[state->rxnext++] - 0xfe;
-        if ((result & 0xfe) == 0)
-            return result;
-        /* checksum error */
+        while (count > 0 && state->rxnext < state->rxcnt) {
+            uint8_t byte = state->rxbuf[state->rxnext++];
+            if ((byte & 0xfe) == 0xfe) {
+                *bits++ = byte;
+                --count;
+            }
+            /* otherwise checksum error */
+        }
     }
-}
-
-/* IterateLFSR - get the next bit in the lfsr sequence */
-static int IterateLFSR(PL_state *state)
-{
-    uint8_t lfsr = state->lfsr;
-    int result = lfsr & 1;
-    state->lfsr = ((lfsr << 1) & 0xfe) | (((lfsr >> 7) ^ (lfsr >> 5) ^ (lfsr >> 4) ^ (lfsr >> 1)) & 1);
-    return result;
+    return 0;
 }
 
 /* end of code adapted from Chip Gracey's PNut IDE */
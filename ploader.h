@@ -21,6 +21,15 @@ extern "C"
 #define LOAD_STS_ERROR                  -1
 #define LOAD_STS_TIMEOUT                -2
 
+#define SPIN_IMAGE_OK                   0
+#define SPIN_IMAGE_TOO_SMALL            1
+#define SPIN_IMAGE_TOO_BIG              2
+#define SPIN_IMAGE_NOT_LONG_ALIGNED     3
+#define SPIN_IMAGE_BAD_CLKFREQ          4
+#define SPIN_IMAGE_BAD_CLKMODE          5
+#define SPIN_IMAGE_BAD_HEADER           6
+#define SPIN_IMAGE_BAD_CHECKSUM         7
+
 #define LOAD_TYPE_SHUTDOWN              0
 #define LOAD_TYPE_RUN                   1
 #define LOAD_TYPE_EEPROM                2
@@ -32,8 +41,14 @@ extern "C"
 #define MinResetDelay                   60      // Minimum post-reset delay
 #define MaxResetDelay                   500     // Maximum post-reset delay
 
+/* margin added to each computed load phase deadline (in ms) */
+#define DefaultTimeoutMargin            500
+
+/* Each long is sent as 11 bytes of 3 bits each */
+#define BytesPerLong                    11
+
 /* Transmit buffer size is 32K / 4 = 8K longs * 11 bytes per long plus two longs for the command and size */
-#define TxBufSize                       ((((1024 * 32) / 4) + 2) * 11)
+#define TxBufSize                       ((((1024 * 32) / 4) + 2) * BytesPerLong)
 
 /* Receive buffer is large enough to receive max possible bytes during reset + 250 bytes for handshake response */
 #define RxBufSize                       (((BaudRate / 10 * (ResetPulsePeriod + MaxResetDelay) / 1000) & 0xFFFFFFFE) + 258)
@@ -46,11 +61,26 @@ typedef struct {
     int (*tx)(void *data, uint8_t* buf, int n);
     int (*rx_timeout)(void *data, uint8_t* buf, int n, int timeout);
     void (*msleep)(void *data, int msecs);
+    unsigned long (*msclock)(void *data);
     void *serialData;
     
     /* propeller version */
     int version;
     
+    /* offset of the first bit of the handshake response that didn't match or -1 */
+    int handshakeErrorBit;
+    
+    /* milliseconds from the start of the last acknowledgement wait until the ack arrived */
+    int ackLatency;
+    
+    /* load deadlines - baudRate and timeoutMargin are set by the caller and the
+       phase timeouts (in milliseconds) are computed by PL_LoadSpinBinary */
+    int baudRate;
+    int timeoutMargin;
+    int checksumTimeout;
+    int eepromProgrammingTimeout;
+    int eepromVerificationTimeout;
+    
     /* load progress interface */
     void (*progress)(void *data, int phase);
     void *progressData;
@@ -61,7 +91,6 @@ typedef struct {
     uint8_t rxbuf[RxBufSize];
     int rxnext;
     int rxcnt;
-    uint8_t lfsr;
 } PL_state;
 
 /* PL_Init - Initializes the loader state structure. */
@@ -78,6 +107,38 @@ int PL_HardwareFound(PL_state *state, int *pVersion);
 */
 int PL_LoadSpinBinary(PL_state *state, int loadType, uint8_t *image, int size);
 
+/* PL_ValidateSpinBinary - Checks the size, header and checksum of a Spin binary image
+   without touching the hardware. Returns SPIN_IMAGE_OK if the image looks loadable or one
+   of the other SPIN_IMAGE_ codes describing the first problem found.
+*/
+int PL_ValidateSpinBinary(uint8_t *image, int size);
+
+/* PL_SpinImageError - Returns a description of a PL_ValidateSpinBinary result code. */
+const char *PL_SpinImageError(int sts);
+
+/* PL_SpinLoadSize - Returns the number of bytes of a Spin binary image that need to be sent
+   to the ROM loader. The ROM loader clears the rest of hub memory and sets the initial stack
+   frame itself so everything from vbase on can be dropped as long as it only contains zeros
+   and the stack frame. Returns the original size if the image can't be safely trimmed.
+*/
+int PL_SpinLoadSize(uint8_t *image, int size);
+
+/* PL_EncodedSize - Returns the number of bytes needed to hold an encoded image of the given size. */
+#define PL_EncodedSize(size)            (((size) / 4) * BytesPerLong)
+
+/* PL_EncodeSpinBinary - Encodes a Spin binary image into the ROM loader wire format. The
+   wire buffer must be at least PL_EncodedSize(size) bytes long. Returns the number of bytes
+   written. The encoded image does not depend on the load type and can be reused for any
+   number of loads.
+*/
+int PL_EncodeSpinBinary(uint8_t *image, int size, uint8_t *wire);
+
+/* PL_LoadEncodedSpinBinary - Loads a Spin binary image that was encoded by PL_EncodeSpinBinary.
+   The encoded image is passed directly to the tx function without being copied. Must be
+   called immediately following a successful call to PL_HardwareFound.
+*/
+int PL_LoadEncodedSpinBinary(PL_state *state, int loadType, uint8_t *wire, int wireSize);
+
 /* PL_Shutdown - Shutdown the loader.*/
 void PL_Shutdown(PL_state *state);
 
@@ -3,8 +3,23 @@
 #include <limits.h>
 #include "port.h"
 #include "ploader.h"
+#include "helper.h"
+#include "settings.h"
 #include "osint.h"
 
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+/* reset delay calibration */
+#define CALIBRATION_TRIES   5       // number of handshakes that must succeed at each delay
+#define CALIBRATION_PAD     10      // added to the shortest working delay (in ms)
+
+/* adapter setting names */
+#define RESET_DELAY_SETTING "reset-delay"
+#define MAX_BAUD_SETTING    "max-baud"
+
 /* CheckPort state structure */
 typedef struct {
     PL_state *state;
@@ -13,16 +28,22 @@ typedef struct {
     char *actualport;
 } CheckPortInfo;
 
+/* post-reset delay set by the user or -1 to use the adapter setting */
+static int resetDelay = -1;
+
 void ShowPorts(PL_state *state, char *prefix);
 int InitPort(PL_state *state, char *prefix, char *port, int baud, int verbose, char *actualport);
 
 static int ShowPort(const char *port, void *data);
 static int CheckPort(const char *port, void *data);
 static int OpenPort(PL_state *state, const char *port, int baud);
+static int TryResetDelay(PL_state *state, int delay);
+static void AdapterId(const char *port, char *id, int size);
 static void cb_reset(void *data);
 static int cb_tx(void *data, uint8_t* buf, int n);
 static int cb_rx_timeout(void *data, uint8_t* buf, int n, int timeout);
 static void cb_msleep(void *data, int msecs);
+static unsigned long cb_msclock(void *data);
 static void cb_progress(void *data, int phase);
 
 void InitPortState(PL_state *state)
@@ -33,6 +54,7 @@ void InitPortState(PL_state *state)
     state->rx_timeout = cb_rx_timeout;
     state->progress = cb_progress;
     state->msleep = cb_msleep;
+    state->msclock = cb_msclock;
 #ifdef RASPBERRY_PI
 {
     char cmd[20] = "gpio,17,0";
@@ -73,6 +95,104 @@ int InitPort(PL_state *state, char *prefix, char *port, int baud, int verbose, c
     return result;
 }
 
+void SetResetDelay(int msecs)
+{
+    resetDelay = msecs;
+}
+
+int CalibrateResetDelay(PL_state *state, const char *port, int verbose)
+{
+    char id[PATH_MAX];
+    int lo, hi, mid;
+    
+    /* make sure the current delay works */
+    hi = get_reset_delay();
+    if (!TryResetDelay(state, hi))
+        return -1;
+    
+    /* binary search for the shortest delay that works every time but not below the minimum */
+    lo = MinResetDelay - 1;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (verbose) {
+            printf("Trying reset delay %d ms\n", mid);
+            fflush(stdout);
+        }
+        if (TryResetDelay(state, mid))
+            hi = mid;
+        else
+            lo = mid;
+    }
+    if (hi < MinResetDelay)
+        hi = MinResetDelay;
+    
+    /* add some padding and leave the chip ready for a load */
+    hi += CALIBRATION_PAD;
+    if (!TryResetDelay(state, hi))
+        return -1;
+    
+    /* remember the delay for this adapter */
+    AdapterId(port, id, sizeof(id));
+    SetAdapterSetting(id, RESET_DELAY_SETTING, hi);
+    
+    return hi;
+}
+
+int ProbeMaxBaud(PL_state *state, const char *port, uint8_t *helper, int helperSize, int maxBaud, int verbose)
+{
+    HL_probe steps[PROBE_MAX_STEPS];
+    char id[PATH_MAX];
+    int count, baud, version, i;
+    
+    /* echo packets through the helper at rising baud rates */
+    if (HL_ProbeBaudRate(state, helper, helperSize, maxBaud, steps, &count, &baud) != LOAD_STS_OK)
+        return -1;
+    if (verbose) {
+        for (i = 0; i < count; ++i)
+            printf("%d baud: %d of %d packets failed (%d%%)\n", steps[i].baudRate,
+                   steps[i].errors, steps[i].packets, steps[i].errors * 100 / steps[i].packets);
+        fflush(stdout);
+    }
+    if (baud == 0)
+        return -1;
+    
+    /* remember the fastest clean rate for this adapter */
+    AdapterId(port, id, sizeof(id));
+    SetAdapterSetting(id, MAX_BAUD_SETTING, baud);
+    
+    /* leave the chip ready for a load */
+    if (PL_HardwareFound(state, &version) != LOAD_STS_OK)
+        return -1;
+    
+    return baud;
+}
+
+int GetAdapterMaxBaud(const char *port, int *pBaud)
+{
+    char id[PATH_MAX];
+    AdapterId(port, id, sizeof(id));
+    return GetAdapterSetting(id, MAX_BAUD_SETTING, pBaud);
+}
+
+static int TryResetDelay(PL_state *state, int delay)
+{
+    int version, i;
+    set_reset_delay(delay);
+    for (i = 0; i < CALIBRATION_TRIES; ++i) {
+        if (PL_HardwareFound(state, &version) != LOAD_STS_OK)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void AdapterId(const char *port, char *id, int size)
+{
+    if (!serial_id(port, id, size)) {
+        strncpy(id, port, size - 1);
+        id[size - 1] = '\0';
+    }
+}
+
 static int ShowPort(const char *port, void *data)
 {
     printf("%s\n", port);
@@ -87,8 +207,11 @@ static int CheckPort(const char *port, void *data)
         printf("Trying %s                    \n", port);
         fflush(stdout);
     }
-    if ((rc = OpenPort(info->state, port, info->baud)) != CHECK_PORT_OK)
+    if ((rc = OpenPort(info->state, port, info->baud)) != CHECK_PORT_OK) {
+        if (info->verbose && rc == CHECK_PORT_NO_PROPELLER && info->state->handshakeErrorBit >= 0)
+            printf("Handshake response mismatch at bit %d\n", info->state->handshakeErrorBit);
         return rc;
+    }
     if (info->actualport) {
         strncpy(info->actualport, port, PATH_MAX - 1);
         info->actualport[PATH_MAX - 1] = '\0';
@@ -98,9 +221,21 @@ static int CheckPort(const char *port, void *data)
 
 static int OpenPort(PL_state *state, const char *port, int baud)
 {
+    char id[PATH_MAX];
+    int delay;
+    
+    /* use the reset delay set by the user or the one calibrated for this adapter */
+    if (resetDelay >= 0)
+        set_reset_delay(resetDelay);
+    else {
+        AdapterId(port, id, sizeof(id));
+        set_reset_delay(GetAdapterSetting(id, RESET_DELAY_SETTING, &delay) ? delay : -1);
+    }
+    
     /* open the port */
     if (serial_init(port, baud) == 0)
         return CHECK_PORT_OPEN_FAILED;
+    state->baudRate = baud;
         
     /* check for a propeller on this port */
     if (PL_HardwareFound(state, &state->version) != LOAD_STS_OK) {
@@ -131,6 +266,11 @@ static void cb_msleep(void *data, int msecs)
     msleep(msecs);
 }
 
+static unsigned long cb_msclock(void *data)
+{
+    return msclock();
+}
+
 static void cb_progress(void *data, int phase)
 {
     switch (phase) {
@@ -14,5 +14,9 @@ enum {
 void InitPortState(PL_state *state);
 void ShowPorts(PL_state *state, char *prefix);
 int InitPort(PL_state *state, char *prefix, char *port, int baud, int verbose, char *actualport);
+void SetResetDelay(int msecs);
+int CalibrateResetDelay(PL_state *state, const char *port, int verbose);
+int ProbeMaxBaud(PL_state *state, const char *port, uint8_t *helper, int helperSize, int maxBaud, int verbose);
+int GetAdapterMaxBaud(const char *port, int *pBaud);
 
 #endif
\ No newline at end of file
@@ -7,3 +7,7 @@ LIBS += -L$${OUT_PWD}/../ploader/ -lploader
 
 SOURCES += \
     ../../p1load.c \
+
+unix {
+    LIBS += -lpthread
+}
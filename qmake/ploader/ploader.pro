@@ -6,11 +6,14 @@ CONFIG += staticlib
 
 SOURCES += \
     ../../ploader.c \
+    ../../helper.c \
     ../../packet.c \
     ../../port.c \
+    ../../settings.c \
 
 HEADERS += \
-    ../../ploader.h
+    ../../ploader.h \
+    ../../helper.h
 
 unix:!macx {
     DEFINES += LINUX
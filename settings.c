@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "settings.h"
+
+/* settings file name - each line has an adapter id, a setting name and a value */
+#define SETTINGS_FILE   ".p1load"
+
+/* maximum length of a line in the settings file */
+#define MAX_LINE        256
+
+static int SettingsPath(char *path, int size);
+static int MoveOver(const char *tmpPath, const char *path);
+
+/* GetAdapterSetting - get a setting for an adapter, returns non-zero if the setting was found */
+int GetAdapterSetting(const char *id, const char *name, int *pValue)
+{
+    char path[PATH_MAX], line[MAX_LINE], lineId[MAX_LINE], lineName[MAX_LINE];
+    int value, found = 0;
+    FILE *fp;
+    
+    /* open the settings file */
+    if (!SettingsPath(path, sizeof(path)) || !(fp = fopen(path, "r")))
+        return 0;
+        
+    /* look for the setting */
+    while (!found && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%s %s %d", lineId, lineName, &value) == 3
+        &&  strcmp(lineId, id) == 0
+        &&  strcmp(lineName, name) == 0) {
+            *pValue = value;
+            found = 1;
+        }
+    }
+    
+    fclose(fp);
+    return found;
+}
+
+/* SetAdapterSetting - set a setting for an adapter, returns non-zero on success */
+int SetAdapterSetting(const char *id, const char *name, int value)
+{
+    char path[PATH_MAX], tmpPath[PATH_MAX + 16], line[MAX_LINE], lineId[MAX_LINE], lineName[MAX_LINE];
+    char *settings = NULL, *p;
+    long size = 0;
+    int lineValue, ok;
+    FILE *fp;
+    
+    /* get the settings file path */
+    if (!SettingsPath(path, sizeof(path)))
+        return 0;
+    
+    /* read the other settings from the existing file */
+    if ((fp = fopen(path, "r")) != NULL) {
+        fseek(fp, 0L, SEEK_END);
+        size = ftell(fp);
+        fseek(fp, 0L, SEEK_SET);
+        if (!(settings = (char *)malloc(size + 1))) {
+            fclose(fp);
+            return 0;
+        }
+        for (p = settings; fgets(line, sizeof(line), fp); ) {
+            if (sscanf(line, "%s %s %d", lineId, lineName, &lineValue) == 3
+            &&  strcmp(lineId, id) == 0
+            &&  strcmp(lineName, name) == 0)
+                continue;
+            strcpy(p, line);
+            p += strlen(line);
+        }
+        size = p - settings;
+        fclose(fp);
+    }
+    
+    /* write the other settings followed by the new one to a file of our own and then replace
+       the settings file with it so another p1load never sees a partly written file */
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%ld", path, (long)getpid());
+    if (!(fp = fopen(tmpPath, "w"))) {
+        if (settings)
+            free(settings);
+        return 0;
+    }
+    if (settings) {
+        fwrite(settings, 1, size, fp);
+        free(settings);
+    }
+    fprintf(fp, "%s %s %d\n", id, name, value);
+    ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok || !MoveOver(tmpPath, path)) {
+        remove(tmpPath);
+        return 0;
+    }
+    
+    return 1;
+}
+
+/* MoveOver - rename a file over another one, returns non-zero on success */
+static int MoveOver(const char *tmpPath, const char *path)
+{
+#ifdef _WIN32
+    /* rename won't replace an existing file on windows */
+    return MoveFileExA(tmpPath, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmpPath, path) == 0;
+#endif
+}
+
+/* SettingsPath - get the path to the settings file in the user's home directory */
+static int SettingsPath(char *path, int size)
+{
+    char *home;
+    if (!(home = getenv("HOME")) && !(home = getenv("USERPROFILE")))
+        return 0;
+    snprintf(path, size, "%s/%s", home, SETTINGS_FILE);
+    return 1;
+}
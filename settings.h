@@ -0,0 +1,8 @@
+#ifndef __SETTINGS_H__
+#define __SETTINGS_H__
+
+/* prototypes */
+int GetAdapterSetting(const char *id, const char *name, int *pValue);
+int SetAdapterSetting(const char *id, const char *name, int value);
+
+#endif